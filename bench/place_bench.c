@@ -0,0 +1,58 @@
+/* Placement time against window count, see `make bench`
+ *
+ * place_find is pure, so this runs without an X server. Frames are spread at
+ * random over a 1920x1080 area and an 800x600 window is placed among them, the
+ * same sweep as the numbers quoted when the occupancy grid went in. */
+
+#include "../place.h"
+#include "../utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define AREA_W 1920
+#define AREA_H 1080
+#define WIN_W 800
+#define WIN_H 600
+#define ROUNDS 200
+
+static unsigned int seed = 1;
+
+static int random_below(int n) {
+    seed = seed * 1103515245 + 12345;
+    return (int)((seed >> 8) % (unsigned int)n);
+}
+
+int main(int argc, char *argv[]) {
+    static const int counts[] = { 0, 25, 100, 200, 400 };
+    struct client_geom area = { 0, 0, AREA_W, AREA_H };
+    struct client_geom *frames = malloc(400 * sizeof(struct client_geom));
+    int rounds = argc > 1 ? atoi(argv[1]) : ROUNDS;
+    int x, y;
+
+    if (frames == NULL || rounds <= 0)
+        return EXIT_FAILURE;
+
+    printf("%8s %10s %10s\n", "windows", "mean us", "worst us");
+    for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+        long total = 0, worst = 0;
+        for (int r = 0; r < rounds; r++) {
+            for (int j = 0; j < counts[i]; j++) {
+                frames[j].width = 200 + random_below(800);
+                frames[j].height = 150 + random_below(600);
+                frames[j].x = random_below(AREA_W - frames[j].width);
+                frames[j].y = random_below(AREA_H - frames[j].height);
+            }
+
+            long start = time_us();
+            place_find(&area, frames, counts[i], WIN_W, WIN_H, PLACE_RES, &x, &y);
+            long took = time_us() - start;
+            total += took;
+            worst = MAX(worst, took);
+        }
+        printf("%8d %10ld %10ld\n", counts[i], total / rounds, worst);
+    }
+
+    free(frames);
+    return EXIT_SUCCESS;
+}
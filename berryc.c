@@ -0,0 +1,111 @@
+/* berryc: send commands to a running berry through its control socket */
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "globals.h"
+#include "utils.h"
+
+static bool write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+static void usage(void) {
+    printf("Usage: berryc [COMMAND]...\n"
+           "Each argument is sent as one command, e.g. berryc 'set b_width 4' 'get t_height'.\n"
+           "Without arguments commands are read from standard input, one per line.\n"
+           "After 'subscribe [focus|title|map|geometry|workspace]...' events are printed until berry exits.\n");
+    exit(EXIT_SUCCESS);
+}
+
+int main(int argc, char *argv[]) {
+    struct sockaddr_un addr;
+    char path[MAXLEN];
+    char buf[4096];
+    bool failed = false;
+    size_t blank_lines = 0, col = 0;
+    ssize_t n;
+
+    if (argc > 1 && (0 == strcmp(argv[1], "-h") || 0 == strcmp(argv[1], "--help")))
+        usage();
+
+    ipc_socket_path(path, sizeof(path));
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "berryc: socket path %s is too long\n", path);
+        return EXIT_FAILURE;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "berryc: could not connect to %s: %s\n", path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    if (argc > 1) {
+        for (int i = 1; i < argc; i++) {
+            if (!write_all(fd, argv[i], strlen(argv[i])) || !write_all(fd, "\n", 1)) {
+                perror("berryc");
+                return EXIT_FAILURE;
+            }
+        }
+    } else {
+        while ((n = read(STDIN_FILENO, buf, sizeof(buf))) > 0) {
+            if (!write_all(fd, buf, n)) {
+                perror("berryc");
+                return EXIT_FAILURE;
+            }
+        }
+    }
+    // the end of the stream also ends the last batch
+    shutdown(fd, SHUT_WR);
+
+    // copy the replies as they arrive, dropping the blank line that ends the final batch
+    while ((n = read(fd, buf, sizeof(buf))) > 0 || (n < 0 && errno == EINTR)) {
+        for (ssize_t i = 0; i < n; i++) {
+            if (buf[i] == '\n') {
+                if (col == 0)
+                    blank_lines++;
+                else
+                    putchar('\n');
+                col = 0;
+                continue;
+            }
+            for (; blank_lines > 0; blank_lines--)
+                putchar('\n');
+            // replies starting with "error" make berryc fail
+            if (col < 5 && buf[i] != "error"[col])
+                col = 6;
+            else if (col < 5 && ++col == 5)
+                failed = true;
+            putchar(buf[i]);
+        }
+        fflush(stdout); // subscribers read events line by line
+    }
+    for (; blank_lines > 1; blank_lines--)
+        putchar('\n');
+
+    close(fd);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
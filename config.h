@@ -11,15 +11,18 @@
 #define DEFAULT_FONT "System-ui 12"
 
 #define WORKSPACE_NUMBER 2
+#define WORKSPACE_MAX 128
 
 #define BORDER_WIDTH 0
 #define INTERNAL_BORDER_WIDTH 4
 #define TITLE_HEIGHT 28
 #define BOTTOM_HEIGHT 8
+#define CORNER_RADIUS 0 /* 0 keeps square frames */
 
 #define MOVE_STEP 40
 #define RESIZE_STEP 40
 #define PLACE_RES 10
+#define TILE_MASTER_PERCENT 55
 
 #define TOP_GAP 0
 #define BOT_GAP 0
@@ -32,6 +35,7 @@
 
 #define TEXT_FOCUS_COLOR "#000000"
 #define TEXT_UNFOCUS_COLOR "#dddddd"
+#define TEXT_HUNG_COLOR "#808080" /* title of a client that does not answer pings */
 
 #define FOCUS_NEW true
 #define FOCUS_MOTION true
@@ -49,13 +53,20 @@
 #define MANAGE_UTILITY true
 
 #define DECORATE_NEW true
+#define REPARENT true /* false leaves client windows on the root, each frame stacked right below its window */
 #define MOVE_BUTTON 1
 #define MOVE_MASK Mod4Mask
 #define RESIZE_BUTTON 3
 #define RESIZE_MASK Mod4Mask
 #define POINTER_INTERVAL 0
-#define FOLLOW_POINTER true
+#define DEFER_BUDGET_US 2000 /* time per wakeup for property, expose and configure events once input is handled */
+#define DRAG_FRAME_MS 8 /* drags move or resize a window at most once per frame of this many ms */
+#define FOLLOW_POINTER false
+#define HOVER_DELAY_MS 150 /* the pointer rests this long on a window before it follows, see FOLLOW_POINTER */
 #define WARP_POINTER false
 #define DOUBLECLICK_INTERVAL 200
+#define CONFIGURE_RATE_MAX 60 /* a client sending more configure requests per second is throttled */
+#define PING_TIMEOUT_MS 3000 /* a client that takes longer to answer _NET_WM_PING is hung */
+#define TERM_TIMEOUT_MS 2000 /* a hung client closed again gets this long to exit on SIGTERM before SIGKILL */
 
 #endif
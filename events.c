@@ -0,0 +1,240 @@
+/* Event batching and coalescing, see events.h */
+
+#include "events.h"
+#include "globals.h"
+
+#include <string.h>
+
+static XEvent batch[EVENTS_BATCH];
+static int head = 0, tail = 0; /* live events are in [head, tail), taken ones have type 0 */
+static int scan = 0;           /* every event before it that events_next may take is taken */
+static int live = 0;           /* events in the batch not yet taken */
+static int deferred = 0;       /* the deferrable ones among them */
+static unsigned long taken = 0, handed = 0;
+
+// Events whose handlers read on from the Xlib queue, or whose data Xlib frees with the next event
+static bool is_barrier(int type) {
+    return type == KeyPress || type == KeyRelease || type == ButtonPress || type == ButtonRelease ||
+           type == GenericEvent;
+}
+
+static bool is_lifecycle(int type) {
+    return type == CreateNotify || type == MapRequest || type == MapNotify || type == UnmapNotify ||
+           type == ReparentNotify || type == DestroyNotify;
+}
+
+// Cosmetic events, handled after input within the budget of a wakeup
+static bool is_deferrable(int type) {
+    return type == PropertyNotify || type == Expose || type == ConfigureNotify || type == ConfigureRequest;
+}
+
+static bool is_collapsible(int type) {
+    return type == PropertyNotify || type == Expose || type == ConfigureNotify || type == MotionNotify ||
+           type == EnterNotify || type == ConfigureRequest;
+}
+
+// The window an event is about, which for requests and substructure events is not xany.window
+static Window subject(const XEvent *e) {
+    switch (e->type) {
+    case CreateNotify:
+        return e->xcreatewindow.window;
+    case MapRequest:
+        return e->xmaprequest.window;
+    case MapNotify:
+        return e->xmap.window;
+    case UnmapNotify:
+        return e->xunmap.window;
+    case ReparentNotify:
+        return e->xreparent.window;
+    case DestroyNotify:
+        return e->xdestroywindow.window;
+    case ConfigureNotify:
+        return e->xconfigure.window;
+    case ConfigureRequest:
+        return e->xconfigurerequest.window;
+    default:
+        return e->xany.window;
+    }
+}
+
+// Does the later event make e redundant? Both are of the same type
+static bool supersedes(const XEvent *later, const XEvent *e) {
+    switch (later->type) {
+    case PropertyNotify:
+        return later->xproperty.window == e->xproperty.window && later->xproperty.atom == e->xproperty.atom;
+    case ConfigureNotify:
+        // a client window reports to itself and to its parent, keep one of each
+        return later->xconfigure.window == e->xconfigure.window && later->xconfigure.event == e->xconfigure.event;
+    case EnterNotify:
+        // only where a sweep ends matters, crossings caused by grabs and within a frame are kept
+        return later->xcrossing.mode == NotifyNormal && e->xcrossing.mode == NotifyNormal &&
+               later->xcrossing.detail != NotifyInferior;
+    default:
+        return subject(later) == subject(e);
+    }
+}
+
+// Drop the event ev replaces, looking back no further than a lifecycle change of its window
+static void collapse(XEvent *ev) {
+    Window w = subject(ev);
+
+    for (int i = tail - 1; i >= head; i--) {
+        XEvent *e = &batch[i];
+        if (e->type == ev->type && supersedes(ev, e)) {
+            if (ev->type == ConfigureRequest) {
+                XConfigureRequestEvent merged = e->xconfigurerequest;
+                events_merge_configure(&merged, &ev->xconfigurerequest);
+                ev->xconfigurerequest = merged;
+            }
+            if (is_deferrable(e->type))
+                deferred--;
+            live--;
+            e->type = 0; // skipped by events_next
+            return;
+        }
+        if (is_lifecycle(e->type) && subject(e) == w)
+            return;
+    }
+}
+
+/* XCheckIfEvent predicate for the first input event that only deferrable events
+ * are queued ahead of, arg points to a flag set once anything else is passed */
+static Bool input_ahead(Display *dpy, XEvent *e, XPointer arg) {
+    bool *blocked = (bool *)arg;
+    (void)dpy;
+
+    if (*blocked)
+        return False;
+    if (is_barrier(e->type))
+        return True;
+    if (!is_deferrable(e->type))
+        *blocked = true;
+    return False;
+}
+
+// Hand out batch[i] and drop it from the batch
+static void take(int i, XEvent *e) {
+    *e = batch[i];
+    if (is_deferrable(e->type))
+        deferred--;
+    live--;
+    batch[i].type = 0;
+    handed++;
+    while (head < tail && batch[head].type == 0)
+        head++;
+    if (scan < head)
+        scan = head;
+}
+
+int events_collect(Display *dpy) {
+    XEvent next;
+    int count = 0;
+
+    if (head > 0) {
+        memmove(batch, batch + head, (tail - head) * sizeof(XEvent));
+        tail -= head;
+        scan -= head;
+        head = 0;
+    }
+
+    // the last slot is kept for input, see below
+    while (tail < EVENTS_BATCH - 1 && XPending(dpy)) {
+        // deferred events may wait, anything else still has to be handled first
+        XPeekEvent(dpy, &next);
+        if (is_barrier(next.type) && live > deferred)
+            break;
+
+        XEvent *ev = &batch[tail];
+        XNextEvent(dpy, ev);
+        taken++;
+        count++;
+        if (is_collapsible(ev->type))
+            collapse(ev);
+        if (is_deferrable(ev->type))
+            deferred++;
+        live++;
+        tail++;
+        if (is_barrier(ev->type))
+            return count;
+    }
+
+    // a full batch of deferred events does not hold up input queued behind more of them
+    if (tail == EVENTS_BATCH - 1 && live == deferred && XPending(dpy)) {
+        bool blocked = false;
+        if (XCheckIfEvent(dpy, &batch[tail], input_ahead, (XPointer)&blocked)) {
+            taken++;
+            count++;
+            live++;
+            tail++;
+        }
+    }
+    return count;
+}
+
+bool events_next(XEvent *e) {
+    for (; scan < tail; scan++) {
+        int type = batch[scan].type;
+        if (type == 0 || is_deferrable(type))
+            continue;
+
+        // deferred events of a window are handled before it changes, e.g. is unmapped
+        if (is_lifecycle(type)) {
+            Window w = subject(&batch[scan]);
+            for (int i = head; i < scan; i++) {
+                if (batch[i].type != 0 && subject(&batch[i]) == w) {
+                    take(i, e);
+                    return true;
+                }
+            }
+        }
+        // input may move or resize a window itself, older requests must not undo that
+        if (is_barrier(type)) {
+            for (int i = head; i < scan; i++) {
+                if (batch[i].type == ConfigureRequest) {
+                    take(i, e);
+                    return true;
+                }
+            }
+        }
+        take(scan, e);
+        return true;
+    }
+    return false;
+}
+
+bool events_next_deferred(XEvent *e) {
+    for (int i = head; i < tail; i++) {
+        if (is_deferrable(batch[i].type)) {
+            take(i, e);
+            return true;
+        }
+    }
+    return false;
+}
+
+int events_deferred(void) {
+    return deferred;
+}
+
+void events_merge_configure(XConfigureRequestEvent *ev, const XConfigureRequestEvent *later) {
+    if (later->value_mask & CWX)
+        ev->x = later->x;
+    if (later->value_mask & CWY)
+        ev->y = later->y;
+    if (later->value_mask & CWWidth)
+        ev->width = later->width;
+    if (later->value_mask & CWHeight)
+        ev->height = later->height;
+    if (later->value_mask & CWBorderWidth)
+        ev->border_width = later->border_width;
+    if (later->value_mask & CWSibling)
+        ev->above = later->above;
+    if (later->value_mask & CWStackMode)
+        ev->detail = later->detail;
+    ev->value_mask |= later->value_mask;
+}
+
+void events_counts(unsigned long *in, unsigned long *dispatched) {
+    *in = taken;
+    *dispatched = handed;
+}
@@ -0,0 +1,42 @@
+#ifndef _BERRY_EVENTS_H_
+#define _BERRY_EVENTS_H_
+
+#include "types.h"
+
+/* Events are moved from the Xlib queue into a batch before they are handled.
+ * A later event that makes an earlier one redundant replaces it: the latest
+ * PropertyNotify per window and atom, Expose, ConfigureNotify and MotionNotify
+ * per window, crossing of a pointer sweep and ConfigureRequest per window, the
+ * latter merged field by field. Nothing is collapsed across the mapping,
+ * unmapping, reparenting or destruction of its window. */
+
+/* Property, expose and configure events are deferrable: input and every other
+ * event are handed out first, and deferred events wait for events_next_deferred,
+ * which the caller runs under a time budget. Only before a window is created,
+ * mapped, unmapped, reparented or destroyed are its deferred events handed out
+ * with the rest. */
+
+/* Fill the batch from the events Xlib has queued, returns how many were taken.
+ * Input and generic events end a batch and join it only once nothing but
+ * deferred events is left, so the drags and key handling that read on from the
+ * Xlib queue see every event after them. When the batch fills up with deferred
+ * events, the first input event queued behind more of them is taken ahead. */
+int events_collect(Display *dpy);
+
+/* Take the oldest event that is not deferred, false once there is none. Deferred
+ * ConfigureRequests are handed out before input. */
+bool events_next(XEvent *e);
+
+/* Take the oldest deferred event, false once there is none */
+bool events_next_deferred(XEvent *e);
+
+/* Deferred events waiting in the batch */
+int events_deferred(void);
+
+/* Fold a later ConfigureRequest for the same window into an earlier one */
+void events_merge_configure(XConfigureRequestEvent *ev, const XConfigureRequestEvent *later);
+
+/* Events taken from Xlib and events handed out so far */
+void events_counts(unsigned long *in, unsigned long *dispatched);
+
+#endif
@@ -0,0 +1,59 @@
+/* Background fontconfig initialization, see font.h */
+
+#include "font.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fontconfig/fontconfig.h>
+#include <pthread.h>
+#include <unistd.h>
+
+static pthread_t thread;
+static int notify[2] = { -1, -1 };
+static bool init_ok = false;
+
+static void *prepare(void *arg) {
+    (void)arg;
+    init_ok = FcInit();
+    // the byte only wakes up poll, joining the thread publishes init_ok
+    while (write(notify[1], "", 1) < 0 && errno == EINTR)
+        ;
+    return NULL;
+}
+
+static void notify_close(void) {
+    close(notify[0]);
+    close(notify[1]);
+    notify[0] = notify[1] = -1;
+}
+
+bool font_prepare(void) {
+    if (notify[0] != -1)
+        return true;
+
+    if (pipe(notify) < 0) {
+        notify[0] = notify[1] = -1;
+        return false;
+    }
+    fcntl(notify[0], F_SETFD, FD_CLOEXEC);
+    fcntl(notify[1], F_SETFD, FD_CLOEXEC);
+
+    if (pthread_create(&thread, NULL, prepare, NULL) != 0) {
+        notify_close();
+        return false;
+    }
+    return true;
+}
+
+int font_prepare_fd(void) {
+    return notify[0];
+}
+
+bool font_prepare_finish(void) {
+    if (notify[0] == -1)
+        return init_ok;
+
+    pthread_join(thread, NULL);
+    notify_close();
+    return init_ok;
+}
@@ -0,0 +1,15 @@
+#ifndef _BERRY_FONT_H_
+#define _BERRY_FONT_H_
+
+#include <stdbool.h>
+
+/* Fontconfig initialization scans every configured font directory and cache,
+ * which can take hundreds of milliseconds. font_prepare runs it on a thread so
+ * the event loop can start right away. Once font_prepare_fd becomes readable,
+ * font_prepare_finish joins the thread and fonts open without that delay.
+ * font_prepare_fd is -1 while nothing is pending. */
+bool font_prepare(void);
+int font_prepare_fd(void);
+bool font_prepare_finish(void);
+
+#endif
@@ -19,6 +19,10 @@
 
 #define MAXLEN 256
 #define MINIMUM_DIM 30
+#define SHAPE_CACHE_SIZE 16 /* frame masks kept for reuse, see client_shape */
+#define HANDOVER_VERSION 3 /* bump when struct handover_header or struct handover change */
+#define EVENTS_BATCH 256 /* events taken from Xlib at once, see events_collect */
+#define WORKER_QUEUE_SIZE 64 /* jobs in flight on the worker thread, a power of two */
 #define TITLE_X_OFFSET 5
 #define DEFAULT_ALPHA 0xffff
 
@@ -0,0 +1,363 @@
+/* Local control socket for berry, see ipc.h for the framing */
+
+#define _GNU_SOURCE 1 /* struct ucred */
+
+#include "ipc.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+struct ipc_conn {
+    int fd;
+    char *in, *out;
+    size_t in_len, in_cap, out_len, out_cap;
+    bool closing;          /* peer is done sending, close once the replies are written */
+    unsigned int events;   /* subscribed ipc_event mask */
+    unsigned long dropped; /* events lost to a full backlog */
+};
+
+static int listen_fd = -1;
+static char listen_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+static ipc_batch_handler batch_handler = NULL;
+static struct ipc_conn conns[IPC_MAX_CONNS];
+static struct ipc_conn *poll_conns[IPC_MAX_CONNS + 1]; /* connection behind each polled fd */
+static unsigned int subscribed = 0;                    /* union of all subscriptions */
+
+static bool buffer_reserve(char **buf, size_t *cap, size_t need) {
+    if (need <= *cap)
+        return true;
+
+    size_t grow = *cap ? *cap : 256;
+    while (grow < need)
+        grow *= 2;
+
+    char *tmp = realloc(*buf, grow);
+    if (tmp == NULL)
+        return false;
+    *buf = tmp;
+    *cap = grow;
+    return true;
+}
+
+static void subscriptions_update(void) {
+    subscribed = 0;
+    for (int i = 0; i < IPC_MAX_CONNS; i++)
+        if (conns[i].fd != -1)
+            subscribed |= conns[i].events;
+}
+
+static void conn_close(struct ipc_conn *conn) {
+    bool was_subscribed = conn->events != 0;
+
+    close(conn->fd);
+    free(conn->in);
+    free(conn->out);
+    memset(conn, 0, sizeof(struct ipc_conn));
+    conn->fd = -1;
+
+    if (was_subscribed)
+        subscriptions_update();
+}
+
+static bool conn_append(struct ipc_conn *conn, const char *line, size_t len) {
+    if (!buffer_reserve(&conn->out, &conn->out_cap, conn->out_len + len + 1))
+        return false;
+
+    memcpy(conn->out + conn->out_len, line, len);
+    conn->out_len += len;
+    conn->out[conn->out_len++] = '\n';
+    return true;
+}
+
+static void conn_flush(struct ipc_conn *conn) {
+    while (conn->out_len > 0) {
+        ssize_t n = send(conn->fd, conn->out, conn->out_len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                conn_close(conn);
+            return;
+        }
+        memmove(conn->out, conn->out + n, conn->out_len - n);
+        conn->out_len -= n;
+    }
+
+    // subscribers stay connected after they stop sending commands
+    if (conn->closing && conn->events == 0)
+        conn_close(conn);
+}
+
+// Hand every complete batch in the input buffer to the handler
+static void conn_process(struct ipc_conn *conn) {
+    for (;;) {
+        char *end = NULL;
+        size_t skip = 0;
+
+        for (size_t i = 0; i + 1 < conn->in_len; i++) {
+            if (conn->in[i] == '\n' && conn->in[i + 1] == '\n') {
+                end = conn->in + i;
+                skip = i + 2;
+                break;
+            }
+        }
+        if (end == NULL && conn->closing && conn->in_len > 0) {
+            // the last batch may be ended by the end of the stream instead
+            end = conn->in + conn->in_len;
+            skip = conn->in_len;
+        }
+        if (end == NULL)
+            break;
+
+        *end = '\0';
+        batch_handler(conn, conn->in);
+        ipc_reply(conn, "");
+
+        memmove(conn->in, conn->in + skip, conn->in_len - skip);
+        conn->in_len -= skip;
+    }
+
+    conn_flush(conn);
+}
+
+static void conn_read(struct ipc_conn *conn) {
+    for (;;) {
+        // one spare byte so that a batch ended by EOF can be terminated in place
+        if (!buffer_reserve(&conn->in, &conn->in_cap, conn->in_len + 4096 + 1)) {
+            conn_close(conn);
+            return;
+        }
+
+        ssize_t n = recv(conn->fd, conn->in + conn->in_len, conn->in_cap - conn->in_len - 1, 0);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                conn_close(conn);
+            break;
+        }
+        if (n == 0) {
+            conn->closing = true;
+            break;
+        }
+
+        conn->in_len += n;
+        if (conn->in_len > IPC_MAX_REQUEST) {
+            conn->in_len = 0;
+            conn->closing = true;
+            ipc_reply(conn, "error request too large");
+            ipc_reply(conn, "");
+            break;
+        }
+    }
+
+    if (conn->fd != -1)
+        conn_process(conn);
+}
+
+static void conn_accept(void) {
+    int fd;
+    while ((fd = accept(listen_fd, NULL, NULL)) >= 0) {
+        struct ipc_conn *conn = NULL;
+        struct ucred cred;
+        socklen_t len = sizeof(cred);
+
+        // the commands close windows and exec, only the user berry runs as may send them
+        if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0 || cred.uid != getuid()) {
+            close(fd);
+            continue;
+        }
+
+        for (int i = 0; i < IPC_MAX_CONNS && conn == NULL; i++)
+            if (conns[i].fd == -1)
+                conn = &conns[i];
+
+        if (conn == NULL) {
+            close(fd);
+            continue;
+        }
+
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        conn->fd = fd;
+    }
+}
+
+bool ipc_listen(const char *path, ipc_batch_handler handler) {
+    struct sockaddr_un addr;
+
+    for (int i = 0; i < IPC_MAX_CONNS; i++)
+        conns[i].fd = -1;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return false;
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0)
+        return false;
+    fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
+    fcntl(listen_fd, F_SETFD, FD_CLOEXEC);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    // only a socket of our own is left behind by a berry that did not exit cleanly
+    struct stat st;
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode) || st.st_uid != getuid()) {
+            close(listen_fd);
+            listen_fd = -1;
+            errno = EEXIST;
+            return false;
+        }
+        unlink(path);
+    }
+
+    // the socket is private from the moment it exists
+    mode_t mask = umask(S_IRWXG | S_IRWXO | S_IXUSR);
+    bool ok = bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    umask(mask);
+    if (!ok || listen(listen_fd, 8) < 0) {
+        close(listen_fd);
+        listen_fd = -1;
+        return false;
+    }
+
+    strcpy(listen_path, path);
+    batch_handler = handler;
+    return true;
+}
+
+void ipc_close(void) {
+    if (listen_fd == -1)
+        return;
+
+    for (int i = 0; i < IPC_MAX_CONNS; i++)
+        if (conns[i].fd != -1)
+            conn_close(&conns[i]);
+
+    close(listen_fd);
+    unlink(listen_path);
+    listen_fd = -1;
+}
+
+int ipc_pollfds(struct pollfd *fds, int max) {
+    int n = 0;
+
+    if (listen_fd == -1 || max < 1)
+        return 0;
+
+    fds[n].fd = listen_fd;
+    fds[n].events = POLLIN;
+    poll_conns[n++] = NULL;
+
+    for (int i = 0; i < IPC_MAX_CONNS && n < max; i++) {
+        struct ipc_conn *conn = &conns[i];
+        if (conn->fd == -1)
+            continue;
+        fds[n].fd = conn->fd;
+        fds[n].events = (conn->closing ? 0 : POLLIN) | (conn->out_len ? POLLOUT : 0);
+        poll_conns[n++] = conn;
+    }
+
+    return n;
+}
+
+void ipc_dispatch(const struct pollfd *fds, int n) {
+    for (int i = 0; i < n; i++) {
+        struct ipc_conn *conn = poll_conns[i];
+        if (!fds[i].revents)
+            continue;
+
+        if (conn == NULL) {
+            conn_accept();
+        } else if (conn->fd == fds[i].fd) {
+            if (conn->closing && fds[i].revents & (POLLHUP | POLLERR))
+                conn_close(conn);
+            else if (fds[i].revents & POLLOUT)
+                conn_flush(conn);
+            if (conn->fd != -1 && fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+                conn_read(conn);
+        }
+    }
+}
+
+void ipc_reply(struct ipc_conn *conn, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+
+    if (len < 0 || !buffer_reserve(&conn->out, &conn->out_cap, conn->out_len + len + 2))
+        return;
+
+    va_start(args, fmt);
+    vsnprintf(conn->out + conn->out_len, len + 1, fmt, args);
+    va_end(args);
+
+    // keep replies one line each
+    for (int i = 0; i < len; i++)
+        if (conn->out[conn->out_len + i] == '\n')
+            conn->out[conn->out_len + i] = ' ';
+
+    conn->out_len += len;
+    conn->out[conn->out_len++] = '\n';
+}
+
+void ipc_subscribe(struct ipc_conn *conn, unsigned int events) {
+    conn->events |= events;
+    subscribed |= events;
+}
+
+bool ipc_subscribed(unsigned int event) {
+    return (subscribed & event) != 0;
+}
+
+// Queue an event line for every subscriber, the poll loop writes it out
+void ipc_broadcast(unsigned int event, const char *fmt, ...) {
+    char line[1024], overflow[32];
+    va_list args;
+
+    if (!(subscribed & event))
+        return;
+
+    va_start(args, fmt);
+    int len = vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+    if (len < 0)
+        return;
+    if ((size_t)len >= sizeof(line))
+        len = sizeof(line) - 1;
+    for (int i = 0; i < len; i++)
+        if (line[i] == '\n')
+            line[i] = ' ';
+
+    for (int i = 0; i < IPC_MAX_CONNS; i++) {
+        struct ipc_conn *conn = &conns[i];
+        if (conn->fd == -1 || !(conn->events & event))
+            continue;
+
+        int overflow_len = 0;
+        if (conn->dropped > 0)
+            overflow_len = snprintf(overflow, sizeof(overflow), "overflow %lu", conn->dropped);
+
+        if (conn->out_len + overflow_len + len + 2 > IPC_MAX_BACKLOG) {
+            conn->dropped++;
+            continue;
+        }
+
+        if (conn->dropped > 0 && conn_append(conn, overflow, overflow_len))
+            conn->dropped = 0;
+        if (conn->dropped > 0 || !conn_append(conn, line, len))
+            conn->dropped++;
+    }
+}
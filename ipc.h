@@ -0,0 +1,40 @@
+#ifndef _BERRY_IPC_H_
+#define _BERRY_IPC_H_
+
+#include <poll.h>
+#include <stdbool.h>
+
+#define IPC_MAX_CONNS 32
+#define IPC_MAX_REQUEST (64 * 1024)
+#define IPC_MAX_BACKLOG (64 * 1024) /* unsent events kept per subscriber */
+
+/* A request is a batch of newline separated commands ended by a blank line or by
+ * the client shutting down its side of the socket. The reply holds one line per
+ * command and is ended by a blank line. */
+
+/* A subscribed connection stays open and receives one line per event. Events
+ * that do not fit a slow subscriber's backlog are dropped and replaced by a
+ * single "overflow <count>" line once it catches up. */
+enum ipc_event {
+    IpcEventFocus = 1 << 0,
+    IpcEventTitle = 1 << 1,
+    IpcEventMap = 1 << 2,
+    IpcEventGeometry = 1 << 3,
+    IpcEventWorkspace = 1 << 4,
+    IpcEventAll = (1 << 5) - 1,
+};
+
+struct ipc_conn;
+
+typedef void (*ipc_batch_handler)(struct ipc_conn *conn, char *batch);
+
+bool ipc_listen(const char *path, ipc_batch_handler handler);
+void ipc_close(void);
+int ipc_pollfds(struct pollfd *fds, int max);
+void ipc_dispatch(const struct pollfd *fds, int n);
+void ipc_reply(struct ipc_conn *conn, const char *fmt, ...);
+void ipc_subscribe(struct ipc_conn *conn, unsigned int events);
+bool ipc_subscribed(unsigned int event);
+void ipc_broadcast(unsigned int event, const char *fmt, ...);
+
+#endif
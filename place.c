@@ -0,0 +1,121 @@
+/* Occupancy grid placement for new windows, see place.h */
+
+#include "place.h"
+#include "utils.h"
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int *grid = NULL; /* coverage per cell, built from a difference array */
+static int *sat = NULL;  /* summed-area table of grid, one row and column larger */
+static size_t grid_cap = 0;
+
+// Coverage summed over the cells [x0, x1) x [y0, y1)
+static long sat_sum(int stride, int x0, int y0, int x1, int y1) {
+    return (long)sat[y1 * stride + x1] - sat[y0 * stride + x1] - sat[y1 * stride + x0] + sat[y0 * stride + x0];
+}
+
+static bool grid_reserve(size_t cells) {
+    if (cells <= grid_cap)
+        return true;
+
+    int *g = realloc(grid, cells * sizeof(int));
+    if (g == NULL)
+        return false;
+    grid = g;
+
+    int *s = realloc(sat, cells * sizeof(int));
+    if (s == NULL)
+        return false;
+    sat = s;
+
+    grid_cap = cells;
+    return true;
+}
+
+bool place_find(const struct client_geom *area, const struct client_geom *occupied, int count,
+                int width, int height, int res, int *x, int *y) {
+    if (width > area->width || height > area->height || res <= 0)
+        return false;
+
+    // cells cover the area, the last row and column may stick out of it
+    int gw = (area->width + res - 1) / res;
+    int gh = (area->height + res - 1) / res;
+    int stride = gw + 1;
+    if (!grid_reserve((size_t)stride * (gh + 1)))
+        return false;
+    memset(grid, 0, (size_t)stride * (gh + 1) * sizeof(int));
+
+    // mark the corners of every occupied rect, O(1) per rect
+    for (int i = 0; i < count; i++) {
+        const struct client_geom *r = &occupied[i];
+        int x0 = MAX(r->x - area->x, 0) / res;
+        int y0 = MAX(r->y - area->y, 0) / res;
+        int x1 = (MIN(r->x + r->width - area->x, area->width) + res - 1) / res;
+        int y1 = (MIN(r->y + r->height - area->y, area->height) + res - 1) / res;
+        if (x0 >= x1 || y0 >= y1)
+            continue;
+
+        grid[y0 * stride + x0]++;
+        grid[y0 * stride + x1]--;
+        grid[y1 * stride + x0]--;
+        grid[y1 * stride + x1]++;
+    }
+
+    // prefix sums turn the corners into coverage, a second pass builds the table
+    for (int j = 0; j < gh; j++)
+        for (int i = 1; i < gw; i++)
+            grid[j * stride + i] += grid[j * stride + i - 1];
+    for (int j = 1; j < gh; j++)
+        for (int i = 0; i < gw; i++)
+            grid[j * stride + i] += grid[(j - 1) * stride + i];
+
+    memset(sat, 0, stride * sizeof(int));
+    for (int j = 0; j < gh; j++) {
+        int row = 0;
+        sat[(j + 1) * stride] = 0;
+        for (int i = 0; i < gw; i++) {
+            row += grid[j * stride + i];
+            sat[(j + 1) * stride + i + 1] = sat[j * stride + i + 1] + row;
+        }
+    }
+
+    // rect size in cells, rounded up so that covered cells are never missed
+    int fw = (width + res - 1) / res;
+    int fh = (height + res - 1) / res;
+    if (fw > gw)
+        fw = gw;
+    if (fh > gh)
+        fh = gh;
+
+    // the exact center is off the grid, take it whenever it is free
+    int cx = (area->width - width) / 2, cy = (area->height - height) / 2;
+    int best_x = cx, best_y = cy;
+    long best_cost = sat_sum(stride, cx / res, cy / res, MIN((cx + width + res - 1) / res, gw),
+                             MIN((cy + height + res - 1) / res, gh));
+    long best_dist = 0;
+    bool center_free = best_cost == 0;
+
+    for (int j = 0; j + fh <= gh && !center_free; j++) {
+        for (int i = 0; i + fw <= gw; i++) {
+            long cost = sat_sum(stride, i, j, i + fw, j + fh);
+            if (cost > best_cost)
+                continue;
+
+            int px = MIN(i * res, area->width - width);
+            int py = MIN(j * res, area->height - height);
+            long dist = (long)(px - cx) * (px - cx) + (long)(py - cy) * (py - cy);
+            if (cost < best_cost || dist < best_dist) {
+                best_cost = cost;
+                best_dist = dist;
+                best_x = px;
+                best_y = py;
+            }
+        }
+    }
+
+    *x = area->x + best_x;
+    *y = area->y + best_y;
+    return true;
+}
@@ -0,0 +1,13 @@
+#ifndef _BERRY_PLACE_H_
+#define _BERRY_PLACE_H_
+
+#include "types.h"
+
+/* Find the position for a width x height rect inside area that overlaps the
+ * occupied rects the least, counting a spot covered by two rects twice. Positions
+ * are searched on a grid of res pixels, ties go to the one closest to the center
+ * of area. Returns false if the rect does not fit in area. */
+bool place_find(const struct client_geom *area, const struct client_geom *occupied, int count,
+                int width, int height, int res, int *x, int *y);
+
+#endif
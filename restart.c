@@ -0,0 +1,114 @@
+/* State handover across exec, see restart.h */
+
+#define _GNU_SOURCE 1
+
+#include "restart.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define RESTART_ENV "BERRY_STATE_FD"
+
+static int fd = -1;
+static unsigned char *state = NULL;
+static size_t state_len = 0, state_pos = 0;
+
+bool restart_begin(void) {
+    restart_abort(); // left from an earlier attempt
+    fd = memfd_create("berry-state", MFD_CLOEXEC);
+    return fd != -1;
+}
+
+bool restart_write(const void *data, size_t len) {
+    const char *buf = data;
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+void restart_abort(void) {
+    if (fd != -1)
+        close(fd);
+    fd = -1;
+}
+
+void restart_exec(char *const argv[]) {
+    char value[16];
+
+    // the new process only needs the descriptor, not our offset in it
+    if (fd == -1 || lseek(fd, 0, SEEK_SET) < 0 || fcntl(fd, F_SETFD, 0) < 0) {
+        restart_abort();
+        return;
+    }
+
+    snprintf(value, sizeof(value), "%d", fd);
+    setenv(RESTART_ENV, value, 1);
+    execv("/proc/self/exe", argv);
+
+    unsetenv(RESTART_ENV);
+    restart_abort();
+}
+
+bool restart_resume(void) {
+    struct stat st;
+    char *value = getenv(RESTART_ENV), *end;
+
+    if (value == NULL)
+        return false;
+
+    // children of this berry must not see the variable
+    long n = strtol(value, &end, 10);
+    unsetenv(RESTART_ENV);
+    if (*end != '\0' || n < 0 || n > INT_MAX)
+        return false;
+    fd = n;
+
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        fd = -1;
+        return false;
+    }
+
+    state = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    fd = -1;
+    if (state == MAP_FAILED) {
+        state = NULL;
+        return false;
+    }
+
+    state_len = st.st_size;
+    state_pos = 0;
+    return true;
+}
+
+bool restart_read(void *data, size_t len) {
+    if (state == NULL || len > state_len - state_pos)
+        return false;
+
+    memcpy(data, state + state_pos, len);
+    state_pos += len;
+    return true;
+}
+
+void restart_end(void) {
+    if (state != NULL)
+        munmap(state, state_len);
+    state = NULL;
+    state_len = state_pos = 0;
+}
@@ -0,0 +1,25 @@
+#ifndef _BERRY_RESTART_H_
+#define _BERRY_RESTART_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* In-place restart: the running berry writes its state into an anonymous memory
+ * file and execs its own binary, which finds the file through $BERRY_STATE_FD
+ * and reads the state back in the same order it was written. */
+
+/* The memory file is close-on-exec until restart_exec hands it over */
+bool restart_begin(void);
+bool restart_write(const void *data, size_t len);
+/* Drop the state written so far, after a failed write */
+void restart_abort(void);
+/* Exec into the current binary with the written state, returns only on failure
+ * with the memory file closed */
+void restart_exec(char *const argv[]);
+
+/* True if this process was started by restart_exec and its state is readable */
+bool restart_resume(void);
+bool restart_read(void *data, size_t len);
+void restart_end(void);
+
+#endif
@@ -0,0 +1,215 @@
+/* Memory-mapped client state, see snapshot.h
+ *
+ * The file is a header followed by an open addressing table with linear
+ * probing. Deletion shifts the rest of a probe run back instead of leaving
+ * tombstones, so lookups never scan more than the run they hash into. */
+
+#include "snapshot.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SNAPSHOT_MAGIC 0x62727931 /* "bry1" */
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_MIN_CAPACITY 256
+
+struct snapshot_header {
+    uint32_t magic, version, capacity, count;
+};
+
+struct snapshot_entry {
+    uint64_t window; /* 0 marks a free slot */
+    int32_t ws;
+    int32_t geom[4], prev[4];
+    uint32_t flags;
+};
+
+static int fd = -1;
+static struct snapshot_header *header = NULL;
+static struct snapshot_entry *table = NULL;
+
+static size_t file_size(uint32_t capacity) {
+    return sizeof(struct snapshot_header) + (size_t)capacity * sizeof(struct snapshot_entry);
+}
+
+static uint32_t slot_of(uint64_t window, uint32_t capacity) {
+    return (uint32_t)((window * 0x9e3779b97f4a7c15ull) >> 32) & (capacity - 1);
+}
+
+static bool map(uint32_t capacity) {
+    if (ftruncate(fd, file_size(capacity)) < 0)
+        return false;
+
+    void *mem = mmap(NULL, file_size(capacity), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED)
+        return false;
+
+    header = mem;
+    table = (struct snapshot_entry *)(header + 1);
+    return true;
+}
+
+static void unmap(void) {
+    if (header != NULL)
+        munmap(header, file_size(header->capacity));
+    header = NULL;
+    table = NULL;
+}
+
+static struct snapshot_entry *find(uint64_t window) {
+    uint32_t mask = header->capacity - 1;
+    for (uint32_t i = slot_of(window, header->capacity);; i = (i + 1) & mask) {
+        if (table[i].window == window || table[i].window == 0)
+            return &table[i];
+    }
+}
+
+// Double the table, entries are copied out and hashed back in
+static bool grow(void) {
+    uint32_t capacity = header->capacity;
+    struct snapshot_entry *old = malloc(capacity * sizeof(struct snapshot_entry));
+    if (old == NULL)
+        return false;
+    memcpy(old, table, capacity * sizeof(struct snapshot_entry));
+
+    unmap();
+    if (!map(capacity * 2)) {
+        free(old);
+        if (!map(capacity)) { // nothing left to write to
+            close(fd);
+            fd = -1;
+        }
+        return false;
+    }
+
+    memset(table, 0, (size_t)capacity * 2 * sizeof(struct snapshot_entry));
+    header->capacity = capacity * 2;
+    for (uint32_t i = 0; i < capacity; i++)
+        if (old[i].window != 0)
+            *find(old[i].window) = old[i];
+
+    free(old);
+    return true;
+}
+
+bool snapshot_open(const char *path) {
+    struct stat st;
+
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (fd < 0)
+        return false;
+
+    // reuse the file only if its header agrees with its size
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(struct snapshot_header)) {
+        struct snapshot_header h;
+        if (pread(fd, &h, sizeof(h), 0) == sizeof(h) && h.magic == SNAPSHOT_MAGIC &&
+            h.version == SNAPSHOT_VERSION && h.capacity >= SNAPSHOT_MIN_CAPACITY &&
+            (h.capacity & (h.capacity - 1)) == 0 && (size_t)st.st_size == file_size(h.capacity) &&
+            h.count < h.capacity && map(h.capacity))
+            return true;
+    }
+
+    if (ftruncate(fd, 0) < 0 || !map(SNAPSHOT_MIN_CAPACITY)) {
+        close(fd);
+        fd = -1;
+        return false;
+    }
+    header->magic = SNAPSHOT_MAGIC;
+    header->version = SNAPSHOT_VERSION;
+    header->capacity = SNAPSHOT_MIN_CAPACITY;
+    header->count = 0;
+    return true;
+}
+
+void snapshot_close(void) {
+    unmap();
+    if (fd != -1)
+        close(fd);
+    fd = -1;
+}
+
+void snapshot_put(unsigned long window, const struct snapshot_state *state) {
+    if (header == NULL || window == 0)
+        return;
+
+    struct snapshot_entry *e = find(window);
+    if (e->window == 0) {
+        // keep the table at most half full so probe runs stay short
+        if ((header->count + 1) * 2 > header->capacity) {
+            if (!grow() || header == NULL)
+                return;
+            e = find(window);
+        }
+        e->window = window;
+        header->count++;
+    }
+
+    e->ws = state->ws;
+    e->geom[0] = state->geom.x;
+    e->geom[1] = state->geom.y;
+    e->geom[2] = state->geom.width;
+    e->geom[3] = state->geom.height;
+    e->prev[0] = state->prev.x;
+    e->prev[1] = state->prev.y;
+    e->prev[2] = state->prev.width;
+    e->prev[3] = state->prev.height;
+    e->flags = state->flags;
+}
+
+bool snapshot_get(unsigned long window, struct snapshot_state *state) {
+    if (header == NULL || window == 0)
+        return false;
+
+    struct snapshot_entry *e = find(window);
+    if (e->window == 0)
+        return false;
+
+    state->ws = e->ws;
+    state->geom = (struct client_geom){ e->geom[0], e->geom[1], e->geom[2], e->geom[3] };
+    state->prev = (struct client_geom){ e->prev[0], e->prev[1], e->prev[2], e->prev[3] };
+    state->flags = e->flags;
+    return true;
+}
+
+// Empty slot i and pull back the entries of its probe run that hash at or before it
+static void remove_slot(uint32_t i) {
+    uint32_t mask = header->capacity - 1;
+
+    for (uint32_t j = (i + 1) & mask; table[j].window != 0; j = (j + 1) & mask) {
+        uint32_t home = slot_of(table[j].window, header->capacity);
+        // j stays if its home lies cyclically in (i, j]
+        if ((j > i && (home <= i || home > j)) || (j < i && home <= i && home > j)) {
+            table[i] = table[j];
+            i = j;
+        }
+    }
+    table[i].window = 0;
+    header->count--;
+}
+
+void snapshot_remove(unsigned long window) {
+    if (header == NULL || window == 0)
+        return;
+
+    struct snapshot_entry *e = find(window);
+    if (e->window != 0)
+        remove_slot(e - table);
+}
+
+void snapshot_prune(bool (*keep)(unsigned long window)) {
+    if (header == NULL)
+        return;
+
+    for (uint32_t i = 0; i < header->capacity;) {
+        // a removal may shift another entry into slot i, look at it again
+        if (table[i].window != 0 && !keep(table[i].window))
+            remove_slot(i);
+        else
+            i++;
+    }
+}
@@ -0,0 +1,32 @@
+#ifndef _BERRY_SNAPSHOT_H_
+#define _BERRY_SNAPSHOT_H_
+
+#include "types.h"
+
+/* Client state kept in a memory-mapped file so that a restarted berry can put
+ * every window back where it was. Entries are keyed by client window id and
+ * written in place as state changes, the file is never rewritten as a whole. */
+
+enum snapshot_flags {
+    SnapshotHidden = 1 << 0,
+    SnapshotMono = 1 << 1,
+    SnapshotFullscreen = 1 << 2,
+    SnapshotDecorated = 1 << 3,
+    SnapshotWasFs = 1 << 4,
+};
+
+struct snapshot_state {
+    int ws;
+    struct client_geom geom, prev;
+    unsigned int flags;
+};
+
+bool snapshot_open(const char *path);
+void snapshot_close(void);
+void snapshot_put(unsigned long window, const struct snapshot_state *state);
+bool snapshot_get(unsigned long window, struct snapshot_state *state);
+void snapshot_remove(unsigned long window);
+/* Drop every entry whose window keep() rejects, e.g. windows gone since the snapshot */
+void snapshot_prune(bool (*keep)(unsigned long window));
+
+#endif
@@ -17,6 +17,35 @@ enum WindowType {
     WindowLast
 };
 
+enum Layout {
+    LayoutFloat,
+    LayoutTile, /* master on the left, the other clients stacked on the right */
+    LayoutGrid,
+    LayoutLast
+};
+
+/* Stacking layers, bottom to top */
+enum Layer {
+    LayerDesktop,
+    LayerBelow,
+    LayerNormal,
+    LayerAbove,      /* also unmanaged docks */
+    LayerFullscreen, /* any fullscreen client, whatever its own layer */
+    LayerLast
+};
+
+enum client_protocols {
+    ProtocolDelete = 1 << 0,
+    ProtocolTakeFocus = 1 << 1,
+    ProtocolPing = 1 << 2,
+    ProtocolsKnown = 1 << 7, /* WM_PROTOCOLS has been read at least once */
+};
+
+enum client_fetch {
+    FetchTitle = 1 << 0,
+    FetchProtocols = 1 << 1,
+};
+
 struct client_geom {
     int x, y, width, height;
 };
@@ -24,18 +53,51 @@ struct client_geom {
 typedef struct client {
     Window window, dec;
     int ws, x_hide;
+    unsigned int order; /* map order, keeps tiled layouts stable while focus changes */
+    int layer;
+    unsigned long raised;     /* last raise, orders clients within a layer */
+    struct client *transient; /* managed parent from WM_TRANSIENT_FOR, stacked above it */
+    int shape_w, shape_h;     /* frame size the bounding shape was set for, 0 when unshaped */
+    unsigned int shape_r;
+    unsigned long dec_color; /* frame fill, painted by draw_text */
+    Pixmap title_buf;        /* title bar rendered off-screen, copied to the frame */
+    struct _XftDraw *title_draw;
+    int title_buf_w, title_buf_h; /* buffer size, only ever grown */
+    int title_w, title_h;         /* area last rendered, 0 when the buffer is stale */
     bool decorated, hidden, fullscreen, mono, was_fs, class_hint;
+    bool reparented; /* the window sits inside dec, otherwise dec is a sibling right below it */
+    bool sticky; /* follows every workspace switch on its monitor */
+    bool attention; /* _NET_WM_STATE_DEMANDS_ATTENTION, cleared by the focus */
+    unsigned int net_state; /* net_state bits last written to the window */
+    bool snapshot_dirty; /* state changed since it was last written, see snapshot_flush */
+    unsigned int protocols;                /* client_protocols, read on the worker */
+    unsigned char fetch_busy, fetch_stale; /* client_fetch bits in flight, and to redo once back */
+    long ping_sent; /* time_us of the unanswered _NET_WM_PING, 0 if none */
+    bool hung;      /* the last ping went unanswered for PING_TIMEOUT_MS */
+    long term_sent; /* time_us of the SIGTERM from client_kill, 0 if none */
+    long configure_since;         /* time_us the current second of ConfigureRequests began */
+    unsigned int configure_count; /* ConfigureRequests since configure_since */
+    bool configure_held;          /* configure_last waits for the throttle to end */
+    XConfigureRequestEvent configure_last; /* latest request while throttled, merged */
     struct client_geom geom;
     struct client_geom prev;
-    struct client *next, *f_next;
+    struct client *next, *f_next, *f_prev;
     char title[512];
 } client;
 
+struct workspace {
+    int id, layout;
+    client *c_list;         /* 'stack' of managed clients in drawing order */
+    client *f_list;         /* ordered list for clients to be focused */
+    unsigned int dirty;     /* config changes not yet applied, see refresh_config */
+    struct workspace *next; /* next occupied workspace, ordered by id */
+};
+
 struct config {
-    unsigned int b_width, i_width, t_height, bottom_height, top_gap, bot_gap, left_gap, right_gap, r_step, m_step, move_button, move_mask, resize_button, resize_mask, pointer_interval;
+    unsigned int b_width, i_width, t_height, bottom_height, corner_radius, top_gap, bot_gap, left_gap, right_gap, r_step, m_step, move_button, move_mask, resize_button, resize_mask, pointer_interval, hover_delay;
     unsigned int bf_color, bu_color, if_color, iu_color;
     bool focus_new, focus_motion, t_center, smart_place, draw_text, decorate, fs_remove_dec, fs_max;
-    bool follow_pointer, warp_pointer;
+    bool follow_pointer, warp_pointer, reparent;
     bool manage[WindowLast];
 };
 
@@ -43,17 +105,36 @@ struct monitor {
     int x, y, width, height, screen;
 };
 
+/* Bits of _NET_WM_STATE, see client_update_state */
+enum net_state {
+    NetStateFullscreen = 1 << 0,
+    NetStateMaximizedVert = 1 << 1,
+    NetStateMaximizedHorz = 1 << 2,
+    NetStateHidden = 1 << 3,
+    NetStateAbove = 1 << 4,
+    NetStateBelow = 1 << 5,
+    NetStateSticky = 1 << 6,
+    NetStateDemandsAttention = 1 << 7,
+    NetStateUnwritten = 1 << 8, /* nothing was written yet */
+};
+
 enum atoms_net {
     NetSupported,
     NetNumberOfDesktops,
     NetActiveWindow,
     NetCurrentDesktop,
     NetClientList,
+    NetClientListStacking,
     NetWMStateFullscreen,
     NetWMCheck,
     NetWMState,
     NetWMStateMaximizedVert,
     NetWMStateMaximizedHorz,
+    NetWMStateHidden,
+    NetWMStateAbove,
+    NetWMStateBelow,
+    NetWMStateSticky,
+    NetWMStateDemandsAttention,
     NetWMName,
     NetWMWindowType,
     NetWMWindowTypeMenu,
@@ -68,6 +149,7 @@ enum atoms_net {
     NetWMWindowTypeNotification,
     NetWMWindowTypeCombo,
     NetWMWindowTypeDND,
+    NetWMWindowTypeDesktop,
     NetWMDesktop,
     NetWMFrameExtents,
     NetWMMoveResize,
@@ -75,6 +157,8 @@ enum atoms_net {
     NetDesktopViewport,
     NetWMStrut,
     NetWMStrutPartial,
+    NetWMPing,
+    NetWMPid,
     NetLast
 };
 
@@ -83,13 +167,14 @@ enum atoms_wm {
     WMProtocols,
     WMTakeFocus,
     WMChangeState,
-    WMMotifHints,
+    WMState,
     WMLast,
 };
 
 enum berry_net {
     BerryWindowConfig,
     BerryFontProperty,
+    BerryFrame,
     BerryLast
 };
 
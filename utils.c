@@ -1,6 +1,8 @@
 #include "utils.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 int
 asprintf(char **buf, const char *fmt, ...)
@@ -34,3 +36,54 @@ vasprintf(char **buf, const char *fmt, va_list args)
 	size = vsprintf(*buf, fmt, args);
 	return size;
 }
+
+/* $XDG_RUNTIME_DIR/berry-$DISPLAY<suffix>, falling back to /tmp */
+static void
+runtime_path(char *buf, size_t size, const char *suffix)
+{
+	const char *dir = getenv("XDG_RUNTIME_DIR");
+	const char *disp = getenv("DISPLAY");
+	if (dir == NULL || dir[0] == '\0')
+		dir = "/tmp";
+	if (disp == NULL)
+		disp = "";
+
+	int len = snprintf(buf, size, "%s/" __WINDOW_MANAGER_NAME__ "-", dir);
+	if (len < 0 || (size_t)len >= size)
+		return;
+
+	snprintf(buf + len, size - len, "%s%s", disp, suffix);
+	for (char *p = buf + len; *p != '\0'; p++) {
+		if (*p == '/')
+			*p = '_';
+	}
+}
+
+/* $BERRY_SOCKET, else $XDG_RUNTIME_DIR/berry-$DISPLAY.sock */
+void
+ipc_socket_path(char *buf, size_t size)
+{
+	const char *path = getenv("BERRY_SOCKET");
+	if (path != NULL && path[0] != '\0') {
+		snprintf(buf, size, "%s", path);
+		return;
+	}
+
+	runtime_path(buf, size, ".sock");
+}
+
+/* $XDG_RUNTIME_DIR/berry-$DISPLAY.state, see snapshot.h */
+void
+snapshot_path(char *buf, size_t size)
+{
+	runtime_path(buf, size, ".state");
+}
+
+/* Monotonic microseconds, for timing in debug logs */
+long
+time_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
@@ -3,6 +3,7 @@
 
 #include "types.h"
 #include <stdarg.h>
+#include <stddef.h>
 
 #define MAX(a, b) ((a > b) ? (a) : (b))
 #define MIN(a, b) ((a < b) ? (a) : (b))
@@ -10,4 +11,8 @@
 #define LOGN(msg)      do { if (debug) fprintf(stderr, __WINDOW_MANAGER_NAME__": " msg "\n"); } while (0)
 #define LOGP(msg, ...) do { if (debug) fprintf(stderr, __WINDOW_MANAGER_NAME__": " msg "\n", __VA_ARGS__); } while (0)
 
+void ipc_socket_path(char *buf, size_t size);
+void snapshot_path(char *buf, size_t size);
+long time_us(void);
+
 #endif
@@ -3,37 +3,51 @@
 
 #include "config.h"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <X11/XF86keysym.h>
+#include <X11/XKBlib.h>
 #include <X11/Xatom.h>
 #include <X11/Xft/Xft.h>
 #include <X11/Xlib.h>
 #include <X11/Xproto.h>
 #include <X11/Xutil.h>
 #include <X11/cursorfont.h>
+#include <X11/extensions/XInput2.h>
 #include <X11/extensions/Xinerama.h>
+#include <X11/extensions/Xrandr.h>
 #include <X11/extensions/shape.h>
 #include <xcb/xcb_ewmh.h>
 
+#include "events.h"
+#include "font.h"
 #include "globals.h"
+#include "ipc.h"
+#include "place.h"
+#include "restart.h"
+#include "snapshot.h"
 #include "types.h"
 #include "utils.h"
+#include "worker.h"
 
 static client *f_client = NULL;          /* focused client */
-static client *f_last_client = NULL;     /* previously focused client */
-static client *c_list[WORKSPACE_NUMBER]; /* 'stack' of managed clients in drawing order */
-static client *f_list[WORKSPACE_NUMBER]; /* ordered lists for clients to be focused */
-static struct monitor *m_list = NULL;           /* All saved monitors */
-static struct config conf;                      /* gloabl config */
-static int ws_m_list[WORKSPACE_NUMBER];         /* Mapping from workspaces to associated monitors */
+static struct workspace **ws_list = NULL; /* sparse table of workspaces, NULL while unoccupied */
+static struct workspace *ws_used = NULL;  /* occupied workspaces, ordered by id */
+static int ws_mon[WORKSPACE_MAX];          /* monitor of each workspace, kept while it is unoccupied */
+static struct monitor *m_list = NULL;     /* All saved monitors */
+static struct config conf;                /* gloabl config */
+static int ws_count = WORKSPACE_NUMBER;
 static int curr_ws = 0;
 static int m_count = 0;
 static Cursor move_cursor, normal_cursor;
@@ -42,23 +56,71 @@ static Atom net_atom[NetLast], wm_atom[WMLast], net_berry[BerryLast];
 static Window root, check, nofocus;
 static bool running = true;
 static bool debug = false;
+static bool reparent_windows = REPARENT; /* -n leaves new clients on the root */
 static int screen, display_width, display_height;
 static int (*xerrorxlib)(Display *, XErrorEvent *);
-static XftColor xft_focus_color, xft_unfocus_color;
+static XftColor xft_focus_color, xft_unfocus_color, xft_hung_color;
 static XftFont *font;
 static char global_font[MAXLEN] = DEFAULT_FONT;
 static GC gc;
 static Atom utf8string;
 static Time last_release = 0; /* double-click detection */
 static int alt_tabbing = 0;
+static client *alt_tab_sel = NULL;   /* alt-tab selection, focused once alt is released */
+static client *alt_tab_shown = NULL; /* client last drawn as the selection */
 static bool super_l_only_pressed = 0;
 static bool super_r_only_pressed = 0;
-static unsigned int alt_keycode;
-static unsigned int tab_keycode;
 static unsigned int super_l_keycode;
 static unsigned int super_r_keycode;
+static int xkb_event_base = -1;
+static int xi_opcode = -1;
+static int randr_event_base = -1;
+static bool monitors_changed = false; /* re-layout once the current burst of events is handled */
+static bool layout_pending = false;   /* the current workspace needs tiling, see ws_layout_dirty */
+static unsigned int client_order = 0;
+static unsigned long raise_seq = 0;
+static bool restack_pending = false; /* stacking order changed, see stack_apply */
+static bool stack_resync = false;    /* the server's order is unknown, restack everything */
+static bool stack_members = false;   /* windows came or went, _NET_CLIENT_LIST_STACKING is stale */
+static Window *stack_applied = NULL; /* frames top to bottom as last sent to the server */
+static size_t stack_applied_len = 0, stack_applied_cap = 0;
+static Window *docks = NULL; /* unmanaged dock windows, kept in the above layer */
+static size_t dock_count = 0, dock_cap = 0;
+static bool shape_supported = false;
+static bool snapshot_pending = false; /* some client has snapshot_dirty set */
 static unsigned int flight = True;
 static bool suppress_raise = False;
+static bool restarting = false; /* exec a new berry once run() returns, see handover_exec */
+static bool resuming = false;   /* started by a restart, clients come from handover_adopt */
+static Window hover_window = None;        /* client the pointer entered, see hover_check */
+static long hover_due = 0;                /* time_us at which hover_window gets the focus */
+static unsigned long crossing_serial = 0; /* crossings up to this request come from berry itself */
+
+/* State a restart hands to the new process: the header, one (id, layout) pair per
+ * occupied workspace and one handover per client in c_list order */
+struct handover_header {
+    unsigned int version, conf_size, client_size;
+    int curr_ws, ws_count, workspaces, count;
+    Window focused;
+    struct config conf;
+};
+
+struct handover {
+    Window window, frame;
+    struct snapshot_state state;
+    unsigned int order;
+    unsigned long raised;
+    int layer, x_hide;
+    int focus; /* position in the focus ring of its workspace, 0 is the head */
+    bool reparented;
+};
+
+static struct handover_header handover;
+static int pings_waiting = 0; /* clients with a ping out that are not hung yet */
+static int terms_waiting = 0; /* hung clients sent SIGTERM, see kill_check */
+static int configures_held = 0; /* throttled clients with a request to apply once it ends */
+static bool struts_busy = false;  /* a strut scan is on the worker, see window_find_struts */
+static bool struts_stale = false; /* struts changed during that scan, scan again once it is back */
 
 /* All functions */
 
@@ -66,9 +128,19 @@ static bool suppress_raise = False;
 static void client_center(client *c);
 static void client_center_in_rect(client *c, int x, int y, unsigned w, unsigned h);
 static void client_close(client *c);
+static void client_kill(client *c);
+static void client_ping(client *c);
+static void client_pong(client *c);
+static int ping_check(void);
+static int kill_check(void);
+static int hover_check(void);
+static void crossings_ignore(void);
 static void client_decorations_create(client *cm);
+static void client_decorations_adopt(client *c, Window frame);
 static void client_decorations_show(client *c);
 static void client_decorations_destroy(client *c);
+static bool client_beside_frame(client *c);
+static void client_follow_frame(client *c);
 static void client_delete(client *c);
 static void client_toggle_fullscreen(client *c);
 static void client_fullscreen(client *c, bool toggle, bool fullscreen, bool max);
@@ -81,6 +153,13 @@ static void client_move_to_front(client *c);
 static void client_monocle(client *c);
 static void client_place(client *c);
 static void client_raise(client *c);
+static Window client_frame(client *c);
+static void stack_dirty(void);
+static void stack_apply(void);
+static void stack_track(Window w, bool created);
+static void stack_forget(Window w);
+static void stack_dock_add(Window w);
+static void stack_dock_remove(Window w);
 static void client_refresh(client *c);
 static void client_resize_absolute(client *c, int w, int h);
 static void client_resize_relative(client *c, int w, int h);
@@ -88,29 +167,46 @@ static void client_save(client *c, int ws);
 static void client_send_to_ws(client *c, int ws);
 static void client_set_color(client *c, unsigned long i_color, unsigned long b_color);
 static void client_set_input(client *c);
-static void client_set_title(client *c);
+static void client_shape(client *c);
+static void client_fetch(client *c, unsigned char fetch);
+static void client_fetched(client *c, struct worker_msg *m);
 static void client_show(client *c);
 static void client_snap_left(client *c);
 static void client_snap_right(client *c);
 static void client_toggle_decorations(client *c);
 static void client_try_drag(client *c, int is_move, int x, int y);
 static void client_update_state(client *c);
+static unsigned int client_net_state(client *c);
+static void client_change_state(client *c, long action, unsigned int bits);
+static unsigned int net_state_bit(Atom atom);
+static void client_snapshot(client *c);
+static void snapshot_flush(void);
+static void adopt_windows(void);
+static void frame_unwrap(Window frame, XWindowAttributes *fa);
+static void client_release(client *c);
+static void handover_begin(void);
+static void handover_adopt(void);
+static void handover_exec(char *argv[]);
 static void client_unmanage(client *c);
 
 /* EWMH functions */
-static void ewmh_set_fullscreen(client *c, bool fullscreen);
 static void ewmh_set_viewport(void);
 static void ewmh_set_focus(client *c);
 static void ewmh_set_desktop(client *c, int ws);
 static void ewmh_set_frame_extents(client *c);
 static void ewmh_set_client_list(void);
 static void ewmh_set_desktop_names(void);
+static void ewmh_set_desktop_count(void);
 static void ewmh_set_active_desktop(int ws);
 
 /* Event handlers */
 static void handle_client_message(XEvent *e);
 static void handle_configure_notify(XEvent *e);
 static void handle_configure_request(XEvent *e);
+static Bool configure_request_event(Display *dpy, XEvent *e, XPointer arg);
+static bool client_configure_throttled(client *c, unsigned int requests);
+static void client_configure(client *c, XConfigureRequestEvent *ev);
+static int configure_check(void);
 static void handle_focus(XEvent *e);
 static void handle_map_request(XEvent *e);
 static void handle_unmap_notify(XEvent *e);
@@ -118,32 +214,62 @@ static void handle_reparent_notify(XEvent *e);
 static void handle_destroy_notify(XEvent *e);
 static void handle_button_press(XEvent *e);
 static void handle_key_press(XEvent *e);
-static void handle_key_release(XEvent *e);
 static void handle_expose(XEvent *e);
 static void handle_property_notify(XEvent *e);
 static void handle_enter_notify(XEvent *e);
+static void handle_mapping_notify(XEvent *e);
+static void handle_xkb_event(XEvent *e);
+static void handle_generic_event(XEvent *e);
+static void handle_event(XEvent *e);
+static void handle_randr_event(XEvent *e);
+
+static void keys_refresh(void);
+static unsigned int key_mod_index(unsigned int state);
 
 static void monitors_free(void);
 static void monitors_setup(void);
+static void monitors_update(void);
+static void client_remap_monitor(client *c, const struct monitor *from, const struct monitor *to, bool parked);
 
-static void reorder_focus(void);
+static void focus_ring_remove(struct workspace *w, client *c);
+static void focus_ring_push(struct workspace *w, client *c);
+static void focus_cycle(XKeyEvent *ev, bool backward);
+static void focus_commit(void);
 static void draw_text(client *c, bool focused);
+static void draw_present(client *c);
 static client *get_client_from_window(Window w);
 static void load_config(char *conf_path);
-static void manage_new_window(Window w, XWindowAttributes *wa);
+static void manage_new_window(Window w, XWindowAttributes *wa, const struct handover *h, const struct worker_msg *props,
+                              bool adopting);
+static void manage_fetched(struct worker_msg *m);
+static unsigned int protocol_bit(Atom atom);
 static int manage_xsend_icccm(client *c, Atom atom);
 static void spawn(const char *file, char *const *argv);
-static void refresh_config(void);
+static void refresh_config(unsigned int dirty);
+static void ws_refresh(struct workspace *w, unsigned int dirty);
+static void ws_merge_dirty(int ws, unsigned int dirty);
 static bool safe_to_focus(int ws);
 static void setup(void);
 static Bool check_running(void);
 static void switch_ws(int ws);
+static struct workspace *ws_get(int ws);
+static struct workspace *ws_acquire(int ws);
+static void ws_release(struct workspace *w);
+static client *ws_clients(int ws);
+static client *ws_focus(int ws);
+static int ws_monitor(int ws);
+static bool ws_shown(struct workspace *w);
+static void ws_set_count(int count);
+static void ws_layout_set(int ws, int layout);
+static void ws_layout_dirty(int ws);
+static void ws_layout_apply(struct workspace *w);
+static void ws_layout_cycle(client *c);
+static void ws_next(client *c);
+static void ws_prev(client *c);
 static void warp_pointer(client *c);
 static void usage(void);
 static void version(void);
 static int xerror(Display *display, XErrorEvent *e);
-static int get_actual_x(client *c);
-static int get_actual_y(client *c);
 static int get_actual_width(client *c);
 static int get_actual_height(client *c);
 static int get_dec_width(client *c);
@@ -153,12 +279,18 @@ static int top_height(client *c);
 static void feature_toggle(client *);
 static void send_config(const char *key, const char *value);
 static void update_config(unsigned int offset, unsigned int value);
+static bool config_parse_value(const char *value, unsigned int *out);
+static void ipc_handle_batch(struct ipc_conn *conn, char *batch);
+static unsigned int ipc_command(struct ipc_conn *conn, char *line);
+static void run(void);
+static void font_open(void);
 static void suppress_super_tap(void);
 static void toggle_hide_all(client *);
 static void stop(client *);
+static void restart(client *);
 
-static Bool window_is_undecorated(Window window);
 static void window_find_struts(void);
+static void worker_apply(struct worker_msg *m);
 typedef void (*x11_event_handler_t)(XEvent *e);
 
 /* Native X11 Event handler */
@@ -171,17 +303,28 @@ static const x11_event_handler_t event_handler[LASTEvent] = {
     [ConfigureRequest] = handle_configure_request,
     [ClientMessage] = handle_client_message,
     [KeyPress] = handle_key_press,
-    [KeyRelease] = handle_key_release,
     [ButtonPress] = handle_button_press,
     [PropertyNotify] = handle_property_notify,
     [Expose] = handle_expose,
     [FocusIn] = handle_focus,
     [EnterNotify] = handle_enter_notify,
+    [MappingNotify] = handle_mapping_notify,
+    [GenericEvent] = handle_generic_event,
+};
+
+/* What a config change invalidates on each client */
+enum config_dirty {
+    ConfigColors = 1 << 0,   /* frame colors */
+    ConfigGeometry = 1 << 1, /* frame size and client offsets */
+    ConfigTitle = 1 << 2,    /* title text layout */
+    ConfigLayout = 1 << 3,   /* tiled workspace needs a new layout */
+    ConfigShape = 1 << 4,    /* frame outline */
 };
 
 typedef struct {
     const char *key;
     size_t offset;
+    unsigned int dirty;
 } config_setter;
 
 typedef struct {
@@ -197,25 +340,19 @@ typedef struct {
     client_function function;
 } shortcut;
 
-typedef struct {
-    unsigned long flags;
-    unsigned long functions;
-    unsigned long decorations;
-    long input_mode;
-    unsigned long status;
-} MotifWmHints;
-
-#define CONFIG_VALUE(X) \
-    { #X, offsetof(struct config, X) }
+#define CONFIG_VALUE(X, D) \
+    { #X, offsetof(struct config, X), D }
 static config_setter setters[] = {
-    CONFIG_VALUE(bf_color),
-    CONFIG_VALUE(bu_color),
-    CONFIG_VALUE(if_color),
-    CONFIG_VALUE(iu_color),
-    CONFIG_VALUE(b_width),
-    CONFIG_VALUE(i_width),
-    CONFIG_VALUE(t_height),
-    CONFIG_VALUE(bottom_height),
+    CONFIG_VALUE(bf_color, ConfigColors),
+    CONFIG_VALUE(bu_color, ConfigColors),
+    CONFIG_VALUE(if_color, ConfigColors),
+    CONFIG_VALUE(iu_color, ConfigColors),
+    CONFIG_VALUE(b_width, ConfigGeometry),
+    CONFIG_VALUE(i_width, ConfigGeometry),
+    CONFIG_VALUE(corner_radius, ConfigShape),
+    CONFIG_VALUE(t_height, ConfigGeometry | ConfigTitle),
+    CONFIG_VALUE(bottom_height, ConfigGeometry),
+    CONFIG_VALUE(hover_delay, 0),
 };
 
 static const launcher launchers[] = {
@@ -238,8 +375,14 @@ static const shortcut shortcuts[] = {
     { XK_KP_Add, feature_toggle },
     { XK_d, toggle_hide_all },
     { XK_BackSpace, stop },
+    { XK_r, restart },
+    { XK_Next, ws_next },
+    { XK_Prior, ws_prev },
+    { XK_t, ws_layout_cycle },
 };
 
+static const char *const layout_names[LayoutLast] = { "float", "tile", "grid" };
+
 static const launcher nomod_launchers[] = {
     { XF86XK_AudioLowerVolume, "/home/carl/.config/berry/volumedown.sh", NULL },
     { XF86XK_AudioRaiseVolume, "/home/carl/.config/berry/volumeup.sh", NULL },
@@ -250,7 +393,28 @@ static const int num_launchers = sizeof(launchers) / sizeof(launcher);
 static const int num_nomod_launchers = sizeof(nomod_launchers) / sizeof(launcher);
 static const int num_shortcuts = sizeof(shortcuts) / sizeof(shortcut);
 
-#define MWM_HINTS_DECORATIONS (1L << 1)
+enum key_action_type {
+    KeyNone,
+    KeyLaunch,      /* launchers[arg] */
+    KeyNomodLaunch, /* nomod_launchers[arg] */
+    KeyShortcut,    /* shortcuts[arg] */
+    KeySwitchWs,    /* switch to workspace arg */
+    KeySendWs,      /* send the focused client to workspace arg */
+    KeyFocusNext,   /* alt-tab */
+    KeyFocusPrev,   /* alt-shift-tab */
+};
+
+typedef struct {
+    unsigned char type;
+    unsigned char arg;
+} key_action;
+
+/* Modifier combinations that select a binding: Shift, Control, Mod1 and Mod4 */
+#define KEY_MODS 16
+
+static key_action key_table[256][KEY_MODS]; /* action for each (keycode, modifiers) */
+static uint16_t key_grabs[256];             /* grabbed modifier indices for each keycode */
+
 #define _NET_WM_STATE_REMOVE 0
 #define _NET_WM_STATE_ADD 1
 #define _NET_WM_STATE_TOGGLE 2
@@ -260,7 +424,7 @@ static const int num_shortcuts = sizeof(shortcuts) / sizeof(shortcut);
  */
 static void client_center(client *c) {
     int mon;
-    mon = ws_m_list[c->ws];
+    mon = ws_monitor(c->ws);
     client_center_in_rect(c, m_list[mon].x, m_list[mon].y, m_list[mon].width, m_list[mon].height);
 }
 
@@ -276,50 +440,232 @@ static void client_center_in_rect(client *c, int x, int y, unsigned w, unsigned
     client_refresh(c); // in case we went over the top gap
 }
 
+// Grow the title buffer to at least w x h, it never shrinks
+static bool draw_reserve(client *c, int w, int h) {
+    if (c->title_buf != None && w <= c->title_buf_w && h <= c->title_buf_h)
+        return true;
+
+    w = MAX(w, c->title_buf_w);
+    h = MAX(h, c->title_buf_h);
+    Pixmap buf = XCreatePixmap(display, c->dec, w, h, DefaultDepth(display, screen));
+    if (c->title_buf != None)
+        XFreePixmap(display, c->title_buf);
+    c->title_buf = buf;
+    c->title_buf_w = w;
+    c->title_buf_h = h;
+
+    if (c->title_draw == NULL)
+        c->title_draw = XftDrawCreate(display, buf, DefaultVisual(display, screen), DefaultColormap(display, screen));
+    else
+        XftDrawChange(c->title_draw, buf);
+    return c->title_draw != NULL;
+}
+
+/* Paint the frame. The title bar is rendered into the client's buffer and copied
+ * in one request, the sides and bottom bar are plain fills. The frame has no
+ * background, so the server never clears it in between. */
 static void draw_text(client *c, bool focused) {
-    XftDraw *draw;
-    XftColor *xft_render_color;
     XGlyphInfo extents;
     int x, y, len;
 
-    if (!conf.draw_text) {
-        LOGN("drawing text disabled");
+    if (!c->decorated || c->dec == None)
         return;
-    }
 
-    if (!c->decorated) {
-        LOGN("Client not decorated, not drawing text");
+    int w = MAX(get_actual_width(c), MINIMUM_DIM);
+    int top = top_height(c);
+    if (!draw_reserve(c, w, top))
         return;
-    }
 
-    XftTextExtentsUtf8(display, font, (XftChar8 *)c->title, strlen(c->title), &extents);
-    y = (conf.t_height / 2) + ((extents.y) / 2);
-    x = !conf.t_center ? TITLE_X_OFFSET : (c->geom.width - extents.width) / 2;
+    XSetForeground(display, gc, c->dec_color);
+    XFillRectangle(display, c->title_buf, gc, 0, 0, w, top);
+    c->title_w = w;
+    c->title_h = top;
 
-    for (len = strlen(c->title); len >= 0; len--) {
-        XftTextExtentsUtf8(display, font, (XftChar8 *)c->title, len, &extents);
-        if (extents.xOff < c->geom.width)
-            break;
-    }
+    if (conf.draw_text && font != NULL) { // the font may still be loading
+        XftTextExtentsUtf8(display, font, (XftChar8 *)c->title, strlen(c->title), &extents);
+        y = (conf.t_height / 2) + ((extents.y) / 2);
+        x = !conf.t_center ? TITLE_X_OFFSET : (c->geom.width - extents.width) / 2;
 
-    if (extents.y > (short)conf.t_height) {
-        LOGN("Text is taller than title bar height, not drawing text");
-        return;
+        for (len = strlen(c->title); len >= 0; len--) {
+            XftTextExtentsUtf8(display, font, (XftChar8 *)c->title, len, &extents);
+            if (extents.xOff < c->geom.width)
+                break;
+        }
+
+        if (extents.y > (short)conf.t_height)
+            LOGN("Text is taller than title bar height, not drawing text");
+        else
+            XftDrawStringUtf8(c->title_draw, c->hung ? &xft_hung_color : focused ? &xft_focus_color : &xft_unfocus_color,
+                              font, x, y, (XftChar8 *)c->title, len);
     }
 
-    XClearWindow(display, c->dec);
-    draw = XftDrawCreate(display, c->dec, DefaultVisual(display, screen), DefaultColormap(display, screen));
-    xft_render_color = focused ? &xft_focus_color : &xft_unfocus_color;
+    draw_present(c);
+}
 
-    XftDrawStringUtf8(draw, xft_render_color, font, x, y, (XftChar8 *)c->title, strlen(c->title));
-    XftDrawDestroy(draw);
+// Put the rendered frame on screen, also used to repair exposures
+static void draw_present(client *c) {
+    int w = MAX(get_actual_width(c), MINIMUM_DIM);
+    int h = MAX(get_actual_height(c), MINIMUM_DIM);
+    int top = top_height(c), side = left_width(c);
+    int bottom = top + c->geom.height;
+
+    XCopyArea(display, c->title_buf, c->dec, gc, 0, 0, c->title_w, c->title_h, 0, 0);
+
+    XRectangle rects[] = {
+        { 0, top, side, MAX(h - top, 0) },
+        { w - side, top, side, MAX(h - top, 0) },
+        { 0, bottom, w, MAX(h - bottom, 0) },
+    };
+    XSetForeground(display, gc, c->dec_color);
+    XFillRectangles(display, c->dec, gc, rects, sizeof(rects) / sizeof(rects[0]));
 }
 
 // Try to close a window using soft close protocol.  If it's not supported, destroy the window.
 static void client_close(client *c) {
+    // a client that left its last ping unanswered will not react to a delete either
+    if (c->hung) {
+        client_kill(c);
+        return;
+    }
+
     if (!manage_xsend_icccm(c, wm_atom[WMDeleteWindow])) {
         XDestroyWindow(display, c->window);
+        return;
+    }
+    client_ping(c);
+}
+
+// The pid of a client running on this host, 0 if it runs elsewhere or does not say
+static pid_t client_pid(client *c) {
+    XTextProperty machine;
+    char host[256];
+    unsigned char *prop_ret = NULL;
+    Atom da;
+    int di;
+    unsigned long nitems, dl;
+    pid_t pid = 0;
+
+    if (gethostname(host, sizeof(host)) < 0 || !XGetWMClientMachine(display, c->window, &machine))
+        return 0;
+    bool local = machine.value != NULL && machine.format == 8 &&
+                 0 == strncmp((char *)machine.value, host, sizeof(host));
+    if (machine.value != NULL)
+        XFree(machine.value);
+    if (!local)
+        return 0;
+
+    if (XGetWindowProperty(display, c->window, net_atom[NetWMPid], 0, 1, False, XA_CARDINAL,
+                           &da, &di, &nitems, &dl, &prop_ret) == Success && prop_ret != NULL) {
+        if (nitems == 1)
+            pid = *(unsigned long *)prop_ret;
+        XFree(prop_ret);
+    }
+    return pid;
+}
+
+/* Close a hung client for good. A process running here first gets SIGTERM and
+ * TERM_TIMEOUT_MS to exit, see kill_check. After that, or right away for a
+ * remote client, its process is killed and its connection cut so that the
+ * server frees its windows. init and berry itself are never signalled. */
+static void client_kill(client *c) {
+    pid_t pid = client_pid(c);
+    if (pid == 1 || pid == getpid()) {
+        LOGP("Client 0x%lx claims pid %d, not signalling it", c->window, (int)pid);
+        pid = 0;
+    }
+
+    if (pid > 0 && c->term_sent == 0) {
+        LOGP("Terminating hung client 0x%lx, pid %d", c->window, (int)pid);
+        if (kill(pid, SIGTERM) == 0) {
+            c->term_sent = time_us();
+            terms_waiting++;
+            return;
+        }
+    }
+
+    if (c->term_sent != 0) {
+        c->term_sent = 0;
+        terms_waiting--;
+    }
+    if (pid > 0) {
+        LOGP("Killing hung client 0x%lx, pid %d", c->window, (int)pid);
+        kill(pid, SIGKILL);
+    }
+    XKillClient(display, c->window);
+}
+
+// Ask the client to answer a _NET_WM_PING, see ping_check
+static void client_ping(client *c) {
+    if (c->ping_sent != 0 || !manage_xsend_icccm(c, net_atom[NetWMPing]))
+        return;
+    c->ping_sent = time_us();
+    pings_waiting++;
+}
+
+static void client_pong(client *c) {
+    if (c->ping_sent == 0)
+        return;
+    if (!c->hung)
+        pings_waiting--;
+    c->ping_sent = 0;
+    if (c->hung) {
+        LOGP("Client 0x%lx answers again", c->window);
+        c->hung = false;
+        if (c->term_sent != 0) { // it is responsive, closing it goes through WM_DELETE_WINDOW again
+            c->term_sent = 0;
+            terms_waiting--;
+        }
+        draw_text(c, c == f_client);
+    }
+}
+
+/* Mark the clients whose ping timed out as hung. A hung client keeps its ping
+ * outstanding, a late answer makes it responsive again. Returns the ms until
+ * the next ping times out, -1 if none is waiting. */
+static int ping_check(void) {
+    long now = time_us(), next = -1;
+
+    if (pings_waiting == 0)
+        return -1;
+
+    for (struct workspace *w = ws_used; w != NULL; w = w->next) {
+        for (client *c = w->c_list; c != NULL; c = c->next) {
+            if (c->ping_sent == 0 || c->hung)
+                continue;
+            long left = c->ping_sent + PING_TIMEOUT_MS * 1000L - now;
+            if (left <= 0) {
+                LOGP("Client 0x%lx did not answer its ping, marking it hung", c->window);
+                c->hung = true;
+                pings_waiting--;
+                draw_text(c, c == f_client);
+            } else if (next == -1 || left < next) {
+                next = left;
+            }
+        }
+    }
+    return next == -1 ? -1 : (int)((next + 999) / 1000);
+}
+
+/* Kill the hung clients still around TERM_TIMEOUT_MS after their SIGTERM.
+ * Returns the ms until the next one is due, -1 if none is waiting. */
+static int kill_check(void) {
+    long now = time_us(), next = -1;
+
+    if (terms_waiting == 0)
+        return -1;
+
+    for (struct workspace *w = ws_used; w != NULL; w = w->next) {
+        for (client *c = w->c_list; c != NULL; c = c->next) {
+            if (c->term_sent == 0)
+                continue;
+            long left = c->term_sent + TERM_TIMEOUT_MS * 1000L - now;
+            if (left <= 0)
+                client_kill(c);
+            else if (next == -1 || left < next)
+                next = left;
+        }
     }
+    return next == -1 ? -1 : (int)((next + 999) / 1000);
 }
 
 // create decoration window
@@ -331,23 +677,44 @@ static void client_decorations_create(client *c) {
 
     c->dec = XCreateSimpleWindow(display, root, x, y, w, h, conf.b_width,
                                  conf.bu_color, conf.bf_color);
-
-    XReparentWindow(display, c->window, c->dec, left_width(c), top_height(c));
+    // draw_text paints every pixel, a background would only be cleared over it
+    XSetWindowBackgroundPixmap(display, c->dec, None);
+    XSelectInput(display, c->dec, ExposureMask | (conf.follow_pointer ? EnterWindowMask : 0));
+    // lets a later berry tell frames left behind from client windows, see frame_unwrap
+    XChangeProperty(display, c->dec, net_berry[BerryFrame], XA_WINDOW, 32, PropModeReplace,
+                    (unsigned char *)&c->window, 1);
+
+    if (c->reparented)
+        XReparentWindow(display, c->window, c->dec, left_width(c), top_height(c));
+    else
+        client_follow_frame(c);
 
     draw_text(c, true);
     ewmh_set_frame_extents(c);
 }
 
+/* Take over a frame from the berry that restarted into this one, the client is
+ * already inside or above it and both stay mapped */
+static void client_decorations_adopt(client *c, Window frame) {
+    c->dec = frame;
+    c->dec_color = conf.iu_color; // the focused client gets its colors back with the focus
+    XSelectInput(display, c->dec, ExposureMask | (conf.follow_pointer ? EnterWindowMask : 0));
+    draw_text(c, false);
+    ewmh_set_frame_extents(c);
+}
+
 /* Create new "dummy" windows to be used as decorations for the given client */
 static void client_decorations_show(client *c) {
     c->decorated = true;
+    // a client beside its frame is put back in place by client_refresh
     if (c->mono) {
-        XMoveResizeWindow(display, c->window, left_width(c), top_height(c), c->geom.x - get_dec_width(c), c->geom.y - get_dec_height(c));
+        if (c->reparented)
+            XMoveResizeWindow(display, c->window, left_width(c), top_height(c), c->geom.x - get_dec_width(c), c->geom.y - get_dec_height(c));
         c->geom.x += left_width(c);
         c->geom.y += top_height(c);
         c->geom.height -= get_dec_height(c);
         c->geom.width -= get_dec_width(c);
-    } else {
+    } else if (c->reparented) {
         XMoveWindow(display, c->window, get_dec_width(c), get_dec_height(c));
     }
     draw_text(c, true);
@@ -358,12 +725,13 @@ static void client_decorations_show(client *c) {
 
 static void client_decorations_destroy(client *c) {
     if (c->mono || c->fullscreen) {
-        XMoveResizeWindow(display, c->window, 0, 0, get_actual_width(c), get_actual_height(c));
+        if (c->reparented)
+            XMoveResizeWindow(display, c->window, 0, 0, get_actual_width(c), get_actual_height(c));
         c->geom.x -= left_width(c);
         c->geom.y -= top_height(c);
         c->geom.height = get_actual_height(c);
         c->geom.width = get_actual_width(c);
-    } else {
+    } else if (c->reparented) {
         XMoveWindow(display, c->window, 0, 0);
     }
     c->decorated = false;
@@ -371,23 +739,41 @@ static void client_decorations_destroy(client *c) {
     ewmh_set_frame_extents(c);
 }
 
+// Without reparenting the client window is a sibling of its frame, see conf.reparent
+static bool client_beside_frame(client *c) {
+    return !c->reparented && c->dec != None;
+}
+
+/* Put a client beside its frame where it would sit inside it. Position, size
+ * and stacking right above the frame go in one ConfigureWindow, so the two
+ * never drift apart. */
+static void client_follow_frame(client *c) {
+    XWindowChanges wc;
+    wc.x = c->geom.x + conf.b_width;
+    wc.y = c->geom.y + conf.b_width;
+    wc.width = MAX(c->geom.width, MINIMUM_DIM);
+    wc.height = MAX(c->geom.height, MINIMUM_DIM);
+    wc.sibling = c->dec;
+    wc.stack_mode = Above;
+    XConfigureWindow(display, c->window, CWX | CWY | CWWidth | CWHeight | CWSibling | CWStackMode, &wc);
+}
+
 /* Remove the given Client from the list of currently managed clients
  * Does not free the given client from memory.
  * */
 static void client_delete(client *c) {
-    int ws;
-    ws = c->ws;
+    struct workspace *w = ws_get(c->ws);
 
-    if (ws == -1) {
+    if (w == NULL) {
         LOGN("Cannot delete client, not found");
         return;
     }
 
     // delete in client list
-    if (c_list[ws] == c) {
-        c_list[ws] = c_list[ws]->next;
+    if (w->c_list == c) {
+        w->c_list = w->c_list->next;
     } else {
-        client *tmp = c_list[ws];
+        client *tmp = w->c_list;
         while (tmp != NULL && tmp->next != c)
             tmp = tmp->next;
 
@@ -396,10 +782,13 @@ static void client_delete(client *c) {
     }
 
     // delete in focus list
-    client **cur = &f_list[ws];
-    while (*cur != c)
-        cur = &((*cur)->f_next);
-    *cur = (*cur)->f_next;
+    focus_ring_remove(w, c);
+    if (alt_tab_sel == c)
+        alt_tab_sel = NULL;
+    if (alt_tab_shown == c)
+        alt_tab_shown = NULL;
+
+    ws_release(w);
 
     // need to focus a new window
     if (f_client == c)
@@ -424,14 +813,13 @@ static void client_toggle_fullscreen(client *c) {
 static void client_fullscreen(client *c, bool toggle, bool fullscreen, bool max) {
     LOGP("fullscreen: toggle: %d fullscreen: %d, max: %d", toggle, fullscreen, max);
 
-    int mon = ws_m_list[c->ws];
+    int mon = ws_monitor(c->ws);
     bool to_fs = toggle ? !c->fullscreen : fullscreen;
 
     if (to_fs == c->fullscreen)
         return; // we're already in the desired state
 
     if (to_fs) {
-        ewmh_set_fullscreen(c, true);
         if (c->decorated && conf.fs_remove_dec) {
             client_decorations_destroy(c);
             c->was_fs = true;
@@ -446,8 +834,9 @@ static void client_fullscreen(client *c, bool toggle, bool fullscreen, bool max)
             client_resize_absolute(c, m_list[mon].width, m_list[mon].height);
         }
         c->fullscreen = true;
+        client_shape(c);
+        stack_dirty();
     } else {
-        ewmh_set_fullscreen(c, false);
         if (max) {
             client_move_absolute(c, c->prev.x, c->prev.y);
             client_resize_absolute(c, c->prev.width, c->prev.height);
@@ -461,35 +850,91 @@ static void client_fullscreen(client *c, bool toggle, bool fullscreen, bool max)
 
         c->fullscreen = false;
         c->was_fs = false;
+        client_shape(c);
+        stack_dirty();
         client_refresh(c);
     }
+    client_update_state(c);
 }
 
-// focus the next window in the focus list
-static void focus_next(client *c) {
-    int ws = c != NULL ? c->ws : curr_ws;
-    if (c == NULL) {
-        c = f_list[ws];
+/* The focus list of a workspace is a ring ordered by most recent focus: f_list is
+ * the head and f_list->f_prev the least recently focused client. */
+static void focus_ring_remove(struct workspace *w, client *c) {
+    if (c->f_next == c) {
+        w->f_list = NULL;
+    } else {
+        c->f_prev->f_next = c->f_next;
+        c->f_next->f_prev = c->f_prev;
+        if (w->f_list == c)
+            w->f_list = c->f_next;
     }
+    c->f_next = c->f_prev = NULL;
+}
+
+static void focus_ring_push(struct workspace *w, client *c) {
+    client *head = w->f_list;
+    if (head == NULL) {
+        c->f_next = c->f_prev = c;
+    } else {
+        c->f_next = head;
+        c->f_prev = head->f_prev;
+        head->f_prev->f_next = c;
+        head->f_prev = c;
+    }
+    w->f_list = c;
+}
+
+// Would the next queued event repeat this key press? Detectable autorepeat sends
+// no release in between, so a held key leaves a run of presses in the queue.
+static bool key_repeat_queued(XKeyEvent *ev) {
+    XEvent next;
+
+    if (XEventsQueued(display, QueuedAlready) == 0)
+        return false;
+    XPeekEvent(display, &next);
+    return next.type == KeyPress && next.xkey.keycode == ev->keycode;
+}
+
+// Move the alt-tab selection. Only the frames are recolored here, raising and
+// focusing wait for focus_commit when alt is released.
+static void focus_cycle(XKeyEvent *ev, bool backward) {
+    client *head = ws_focus(curr_ws);
+    if (head == NULL)
+        return;
+
+    if (alt_tab_sel == NULL || alt_tab_sel->ws != curr_ws)
+        alt_tab_sel = head;
+    alt_tab_sel = backward ? alt_tab_sel->f_prev : alt_tab_sel->f_next;
 
-    if (f_list[ws] == NULL) {
+    if (xkb_event_base == -1) { // alt releases are not seen, focus right away
+        client_manage_focus(alt_tab_sel);
         return;
     }
+    alt_tabbing = true;
 
-    if (f_list[ws] == c && f_list[ws]->f_next == NULL) {
-        client_manage_focus(f_list[ws]);
+    client *prev = alt_tab_shown != NULL ? alt_tab_shown : f_client;
+    if (key_repeat_queued(ev) || prev == alt_tab_sel)
         return;
+
+    if (prev != NULL) {
+        client_set_color(prev, conf.iu_color, conf.bu_color);
+        draw_text(prev, false);
     }
+    client_set_color(alt_tab_sel, conf.if_color, conf.bf_color);
+    draw_text(alt_tab_sel, true);
+    alt_tab_shown = alt_tab_sel;
+}
 
-    client *tmp;
-    tmp = c->f_next == NULL ? f_list[ws] : c->f_next;
-    client_manage_focus(tmp);
+static void focus_commit(void) {
+    alt_tabbing = false;
+    if (alt_tab_sel != NULL)
+        client_manage_focus(alt_tab_sel);
 }
 
 // Returns the client associated with the given struct Window
 static client *get_client_from_window(Window w) {
-    for (int i = 0; i < WORKSPACE_NUMBER; i++) {
-        for (client *tmp = c_list[i]; tmp != NULL; tmp = tmp->next) {
+    for (struct workspace *ws = ws_used; ws != NULL; ws = ws->next) {
+        for (client *tmp = ws->c_list; tmp != NULL; tmp = tmp->next) {
             if (tmp->window == w || tmp->dec == w) {
                 return tmp;
             }
@@ -505,53 +950,27 @@ static void handle_client_message(XEvent *e) {
     LOGP("message window 0x%x", (int)cme->window);
     LOGP("client message type %lu", cme->message_type);
     LOGP("message type name %s", XGetAtomName(display, cme->message_type));
-    if (cme->message_type == net_atom[NetWMState]) {
+    if (cme->message_type == wm_atom[WMProtocols] && (Atom)cme->data.l[0] == net_atom[NetWMPing]) {
+        client *c = get_client_from_window(cme->data.l[2]);
+        if (c != NULL && c->window == (Window)cme->data.l[2])
+            client_pong(c);
+    } else if (cme->message_type == net_atom[NetWMState]) {
         client *c = get_client_from_window(cme->window);
         if (c == NULL) {
             LOGN("client not found...");
             return;
         }
-
-        Atom action = (Atom)cme->data.l[1];
-
-        if (action == net_atom[NetWMStateMaximizedHorz] || action == net_atom[NetWMStateMaximizedVert]) {
-            switch (cme->data.l[0]) {
-            case _NET_WM_STATE_ADD:
-                if (!c->mono)
-                    client_monocle(c);
-                break;
-            case _NET_WM_STATE_REMOVE:
-                if (c->mono)
-                    client_monocle(c);
-                break;
-            case _NET_WM_STATE_TOGGLE:
-                client_monocle(c);
-                break;
-            }
-        }
-
-        if ((Atom)cme->data.l[1] == net_atom[NetWMStateFullscreen] ||
-            (Atom)cme->data.l[2] == net_atom[NetWMStateFullscreen]) {
-            LOGN("Recieved fullscreen request");
-            if (cme->data.l[0] == 0) { // remove fullscreen
-                client_fullscreen(c, false, false, true);
-                LOGN("type 0");
-            } else if (cme->data.l[0] == 1) { // set fullscreen
-                client_fullscreen(c, false, true, true);
-                LOGN("type 1");
-            } else if (cme->data.l[0] == 2) { // toggle fullscreen
-                client_fullscreen(c, true, true, true);
-                LOGN("type 2");
-            }
-        }
+        // a message changes up to two states at once, e.g. both maximized ones
+        client_change_state(c, cme->data.l[0], net_state_bit(cme->data.l[1]) | net_state_bit(cme->data.l[2]));
     } else if (cme->message_type == net_atom[NetActiveWindow]) {
         client *c = get_client_from_window(cme->window);
         if (c == NULL)
             return;
-        f_last_client = f_client;
         client_manage_focus(c);
     } else if (cme->message_type == net_atom[NetCurrentDesktop]) {
         switch_ws(cme->data.l[0]);
+    } else if (cme->message_type == net_atom[NetNumberOfDesktops]) {
+        ws_set_count(cme->data.l[0]);
     } else if (cme->message_type == net_atom[NetWMMoveResize]) {
         LOGN("Handling MOVERESIZE");
         client *c = get_client_from_window(cme->window);
@@ -587,129 +1006,178 @@ static void handle_client_message(XEvent *e) {
 
 static void handle_key_press(XEvent *e) {
     XKeyPressedEvent *ev = &e->xkey;
-    KeySym keysym = XKeycodeToKeysym(display, ev->keycode, 0);
-    switch (keysym) {
-    case XK_Super_L:
-        super_l_only_pressed = true;
-        break;
-    case XK_Super_R:
-        super_r_only_pressed = true;
-        break;
-    }
+    const key_action *action = &key_table[ev->keycode & 0xff][key_mod_index(ev->state)];
 
-    if (ev->state & Mod4Mask) {
-        for (int i = 0; i < num_launchers; i++) {
-            if (launchers[i].keysym == keysym && launchers[i].file) {
-                suppress_super_tap();
-                spawn(launchers[i].file, launchers[i].argv);
-                return;
-            }
-        }
-        for (int i = 0; i < num_shortcuts; i++) {
-            if (shortcuts[i].keysym == keysym) {
-                suppress_super_tap();
-                (*(shortcuts[i].function))(f_client);
-                return;
-            }
-        }
-        if (keysym >= XK_1 && keysym <= XK_9) {
-            if (keysym - XK_1 < WORKSPACE_NUMBER) {
-                if (ev->state & ShiftMask) {
-                    client_send_to_ws(f_client, keysym - XK_1);
-                    suppress_super_tap();
-                    return;
-                } else {
-                    switch_ws(keysym - XK_1);
-                    suppress_super_tap();
-                    return;
-                }
-            }
-            suppress_super_tap();
-        }
-    } else if (ev->keycode == tab_keycode) {
-        if (!alt_tabbing) {
-            alt_tabbing = true;
-            if (f_client) {
-                f_last_client = f_client; // prepare a focus item for LRU
-            }
-        }
-        focus_next(f_client);
+    // only bound combinations are grabbed, so every press here belongs to berry
+    switch (action->type) {
+    case KeyLaunch:
+        suppress_super_tap();
+        spawn(launchers[action->arg].file, launchers[action->arg].argv);
+        return;
+    case KeyShortcut:
+        suppress_super_tap();
+        (*(shortcuts[action->arg].function))(f_client);
+        return;
+    case KeySendWs:
+        client_send_to_ws(f_client, action->arg);
+        suppress_super_tap();
+        return;
+    case KeySwitchWs:
+        switch_ws(action->arg);
+        suppress_super_tap();
+        return;
+    case KeyFocusNext:
+    case KeyFocusPrev:
+        focus_cycle(ev, action->type == KeyFocusPrev);
+        return;
+    case KeyNomodLaunch:
+        spawn(nomod_launchers[action->arg].file, nomod_launchers[action->arg].argv);
         return;
-    } else {
-        for (int i = 0; i < num_nomod_launchers; i++) {
-            if (nomod_launchers[i].keysym == keysym && nomod_launchers[i].file) {
-                spawn(nomod_launchers[i].file, nomod_launchers[i].argv);
-                return;
-            }
-        }
-    }
-
-    if (f_client) {
-        XKeyEvent new_event = (*ev);
-        new_event.window = f_client->window;
-        XSendEvent(display, f_client->window, False, KeyPressMask, (XEvent *)&new_event);
     }
 }
 
-// reorder focus list when alt is released, and detect if super key was tapped
-static void handle_key_release(XEvent *e) {
-    XKeyReleasedEvent *ev = &e->xkey;
-    bool super_tapped = false;
-    if (ev->keycode == alt_keycode) {
-        if (alt_tabbing) {
-            alt_tabbing = false;
-            reorder_focus();
-        }
-    } else if (ev->keycode == super_l_keycode) {
-        if (super_l_only_pressed)
-            super_tapped = true;
-        super_l_only_pressed = false;
+// start a new process, fork and exec happen on the worker
+static void spawn(const char *file, char *const *argv) {
+    struct worker_msg m = { .job = WorkerSpawn, .file = file, .argv = argv, .asked = time_us() };
+    if (!worker_post(&m))
+        worker_run(display, &m);
+}
 
-    } else if (ev->keycode == super_r_keycode) {
-        if (super_r_only_pressed)
-            super_tapped = true;
-        super_r_only_pressed = false;
-    }
+/* A pointer drag. Motion is merged between frames and handed out at most once per
+ * DRAG_FRAME_MS, so a 1000 Hz mouse costs no more requests than a 125 Hz one. */
+struct drag {
+    int device;         /* XI2 master pointer grabbed, -1 with a core pointer grab */
+    double x, y;        /* latest pointer position on the root, subpixel with XI2 */
+    unsigned int state; /* modifiers of the latest motion */
+    Time time;
+    bool moved;         /* x, y changed since the last frame */
+    long last_frame;
+    long motions, frames, cpu;
+};
 
-    if (super_tapped) {
-        LOGN("super tapped");
-        spawn(super_tap_launcher.file, super_tap_launcher.argv);
+// Events a drag consumes or handles while the pointer is grabbed
+static Bool drag_event(Display *dpy, XEvent *e, XPointer arg) {
+    struct drag *d = (struct drag *)arg;
+    UNUSED(dpy);
+
+    switch (e->type) {
+    case MotionNotify:
+    case ButtonRelease:
+        return d->device == -1;
+    case FocusIn:
+    case ConfigureRequest:
+    case Expose:
+    case MapRequest:
+        return True;
+    case GenericEvent:
+        return e->xcookie.extension == xi_opcode &&
+               (e->xcookie.evtype == XI_Motion || e->xcookie.evtype == XI_ButtonRelease);
     }
+    return False;
 }
 
-// move the last focused window to be the next one so we can cycle focus between recent windows
-static void reorder_focus(void) {
-    if (f_client && f_last_client && (f_client != f_last_client)) {
-        for (client **cur = &f_list[curr_ws]; *cur != NULL; cur = &((*cur)->f_next)) {
-            if (*cur == f_last_client) {
-                *cur = f_last_client->f_next;
-                f_last_client->f_next = f_client->f_next;
-                f_client->f_next = f_last_client;
-                break;
-            }
-        }
+// Grab the pointer for a drag, with XI2 on the client pointer if possible
+static bool drag_begin(struct drag *d) {
+    memset(d, 0, sizeof(*d));
+    d->device = -1;
+    d->cpu = clock();
+
+    if (xi_opcode != -1 && XIGetClientPointer(display, None, &d->device)) {
+        unsigned char bits[XIMaskLen(XI_LASTEVENT)] = { 0 };
+        XIEventMask mask = { d->device, sizeof(bits), bits };
+        XISetMask(bits, XI_Motion);
+        XISetMask(bits, XI_ButtonRelease);
+        if (XIGrabDevice(display, d->device, root, CurrentTime, normal_cursor, XIGrabModeAsync,
+                         XIGrabModeAsync, False, &mask) == GrabSuccess)
+            return true;
+        d->device = -1;
     }
 
-    f_last_client = NULL;
+    return XGrabPointer(display, root, False, MOUSEMASK, GrabModeAsync, GrabModeAsync, None,
+                        normal_cursor, CurrentTime) == GrabSuccess;
 }
 
-// start a new process
-static void spawn(const char *file, char *const *argv) {
-    struct sigaction sa;
-    if (fork() == 0) {
-        if (display) {
-            close(ConnectionNumber(display));
+static void drag_end(struct drag *d) {
+    // the button grab that started the drag may still hold the core pointer
+    if (d->device != -1)
+        XIUngrabDevice(display, d->device, CurrentTime);
+    XUngrabPointer(display, CurrentTime);
+    LOGP("Drag took %ld motion events, applied %ld frames, %ld us cpu (%s)", d->motions, d->frames,
+         (long)((clock() - d->cpu) * 1000000.0 / CLOCKS_PER_SEC), d->device != -1 ? "XI2" : "core");
+}
+
+/* Wait for the next step of a drag: a ButtonRelease, or one MotionNotify at the
+ * latest pointer position once a frame has passed since the last one. Only the
+ * root relative fields, state and time are filled in. Configure, map and expose
+ * events are handled meanwhile, everything else stays queued. */
+static void drag_next(struct drag *d, XEvent *ev) {
+    long interval = MAX(DRAG_FRAME_MS, conf.pointer_interval) * 1000L;
+    struct pollfd pfd = { ConnectionNumber(display), POLLIN, 0 };
+    XEvent e;
+
+    for (;;) {
+        while (XCheckIfEvent(display, &e, drag_event, (XPointer)d)) {
+            if (e.type == MotionNotify) {
+                d->x = e.xmotion.x_root;
+                d->y = e.xmotion.y_root;
+                d->state = e.xmotion.state;
+                d->time = e.xmotion.time;
+                d->moved = true;
+                d->motions++;
+            } else if (e.type == ButtonRelease) {
+                *ev = e;
+                return;
+            } else if (e.type != GenericEvent) {
+                event_handler[e.type](&e);
+            } else if (XGetEventData(display, &e.xcookie)) {
+                XIDeviceEvent *xi = e.xcookie.data;
+                d->x = xi->root_x;
+                d->y = xi->root_y;
+                d->state = xi->mods.effective;
+                d->time = xi->time;
+                if (e.xcookie.evtype == XI_ButtonRelease) {
+                    memset(ev, 0, sizeof(*ev));
+                    ev->xbutton.type = ButtonRelease;
+                    ev->xbutton.button = xi->detail;
+                    ev->xbutton.subwindow = xi->child;
+                    ev->xbutton.x = ev->xbutton.x_root = xi->root_x;
+                    ev->xbutton.y = ev->xbutton.y_root = xi->root_y;
+                    ev->xbutton.state = d->state;
+                    ev->xbutton.time = d->time;
+                    XFreeEventData(display, &e.xcookie);
+                    return;
+                }
+                d->moved = true;
+                d->motions++;
+                XFreeEventData(display, &e.xcookie);
+            }
         }
-        setsid();
 
-        sigemptyset(&sa.sa_mask);
-        sa.sa_flags = 0;
-        sa.sa_handler = SIG_DFL;
-        sigaction(SIGCHLD, &sa, NULL);
+        long wait = -1;
+        if (d->moved) {
+            long now = time_us();
+            if (now - d->last_frame >= interval) {
+                memset(ev, 0, sizeof(*ev));
+                ev->xmotion.type = MotionNotify;
+                ev->xmotion.x = ev->xmotion.x_root = (int)(d->x + 0.5);
+                ev->xmotion.y = ev->xmotion.y_root = (int)(d->y + 0.5);
+                ev->xmotion.state = d->state;
+                ev->xmotion.time = d->time;
+                d->moved = false;
+                d->last_frame = now;
+                d->frames++;
+                return;
+            }
+            wait = (d->last_frame + interval - now + 999) / 1000;
+        }
 
-        execvp(file, argv);
-        LOGP("failed to run %s", file);
-        exit(1);
+        // the check above read everything available, sleep until more arrives or the frame is due
+        XFlush(display);
+        if (poll(&pfd, 1, wait) < 0 && errno != EINTR) {
+            memset(ev, 0, sizeof(*ev));
+            ev->type = ButtonRelease; // end the drag rather than spin
+            return;
+        }
     }
 }
 
@@ -722,6 +1190,7 @@ static void handle_button_press(XEvent *e) {
     unsigned int dui, state;
     Window root_return, child_return;
     Time current_time, last_motion;
+    struct drag d;
 
     XQueryPointer(display, root, &root_return, &child_return, &x, &y, &di, &di, &dui);
     LOGN("Handling button press event");
@@ -732,7 +1201,6 @@ static void handle_button_press(XEvent *e) {
     // change focus if we have a left-click event
     if (bev->button == 1 && c != f_client) {
         switch_ws(c->ws);
-        f_last_client = f_client;
         client_manage_focus(c);
     }
 
@@ -756,14 +1224,13 @@ static void handle_button_press(XEvent *e) {
     ocy = c->geom.y;
     ocw = c->geom.width;
     och = c->geom.height;
-    last_motion = ev.xmotion.time;
+    last_motion = bev->time;
     bool ignore_buttonup = false;
     bool lower_click = y > ocy + och;
-    if (XGrabPointer(display, root, False, MOUSEMASK, GrabModeAsync, GrabModeAsync, None, normal_cursor, CurrentTime) != GrabSuccess) {
+    if (!drag_begin(&d))
         return;
-    }
     do {
-        XMaskEvent(display, MOUSEMASK | ExposureMask | SubstructureRedirectMask | FocusChangeMask, &ev);
+        drag_next(&d, &ev);
         switch (ev.type) {
         case ButtonRelease:
             if (ignore_buttonup)
@@ -795,12 +1262,6 @@ static void handle_button_press(XEvent *e) {
                 break;
             }
             break;
-        case FocusIn:
-        case ConfigureRequest:
-        case Expose:
-        case MapRequest:
-            event_handler[ev.type](&ev);
-            break;
         case MotionNotify:
             current_time = ev.xmotion.time;
             Time diff_time = current_time - last_motion;
@@ -828,15 +1289,15 @@ static void handle_button_press(XEvent *e) {
                 client_move_absolute(c, nx, ny);
                 ignore_buttonup = true;
             }
-            // XFlush(display); // not needed?
             break;
         }
     } while (ev.type != ButtonRelease);
-    XUngrabPointer(display, CurrentTime);
+    drag_end(&d);
 }
 
 static void client_try_drag(client *c, int is_move, int x, int y) {
     XEvent ev;
+    struct drag d;
     int nx, ny, ocx, ocy, nw, nh, ocw, och, rx, ry;
     unsigned int mask;
     ocx = c->geom.x;
@@ -847,21 +1308,14 @@ static void client_try_drag(client *c, int is_move, int x, int y) {
 
     LOGP("client decorations %s", is_move ? "move" : "resize");
     LOGP("ocx: %d, ocy: %d, x: %d, y: %d\n", ocx, ocy, x, y);
-    if (XGrabPointer(display, root, False, MOUSEMASK, GrabModeAsync, GrabModeAsync, None, normal_cursor, CurrentTime) != GrabSuccess) {
+    if (!drag_begin(&d))
         return;
-    }
     XQueryPointer(display, c->window, &root_return, &client_return, &rx, &ry, &x, &y, &mask);
     do {
-        XMaskEvent(display, MOUSEMASK | ExposureMask | SubstructureRedirectMask | FocusChangeMask, &ev);
+        drag_next(&d, &ev);
         switch (ev.type) {
         case ButtonRelease:
             break;
-        case FocusIn:
-        case ConfigureRequest:
-        case Expose:
-        case MapRequest:
-            event_handler[ev.type](&ev);
-            break;
         case MotionNotify:
             if (!is_move) {
                 nw = ocw + (ev.xmotion.x - rx);
@@ -877,69 +1331,93 @@ static void client_try_drag(client *c, int is_move, int x, int y) {
             break;
         }
     } while (ev.type != ButtonRelease);
-    XUngrabPointer(display, CurrentTime);
+    drag_end(&d);
+}
+
+// net_state bits in order, each with its atom
+static const int net_state_atoms[] = {
+    NetWMStateFullscreen, NetWMStateMaximizedVert, NetWMStateMaximizedHorz, NetWMStateHidden,
+    NetWMStateAbove, NetWMStateBelow, NetWMStateSticky, NetWMStateDemandsAttention,
+};
+
+static unsigned int client_net_state(client *c) {
+    return (c->fullscreen ? NetStateFullscreen : 0) |
+           (c->mono ? NetStateMaximizedVert | NetStateMaximizedHorz : 0) |
+           (c->hidden ? NetStateHidden : 0) |
+           (c->layer == LayerAbove ? NetStateAbove : 0) |
+           (c->layer == LayerBelow ? NetStateBelow : 0) |
+           (c->sticky ? NetStateSticky : 0) |
+           (c->attention ? NetStateDemandsAttention : 0);
 }
 
+/* Write WM_STATE and _NET_WM_STATE from the client's own state. The bits last
+ * written are kept in the client, so a property is only sent when it changes and
+ * never read back. */
 static void client_update_state(client *c) {
-    long data[2];
-    data[0] = c->hidden ? IconicState : NormalState; // NormalState, IconicState, etc.
-    data[1] = None;                                  // Icon window, if applicable
-    XChangeProperty(display, c->window, XInternAtom(display, "WM_STATE", False),
-                    XA_ATOM, 32, PropModeReplace, (unsigned char *)data, 2);
-
-    // the rest of this tries to add or remove horizontal state as needed
-    Atom actualType;
-    int format;
-    unsigned long num_items, bytes_after;
-    Atom *states = NULL;
-    Bool set_maximized = c->mono == True;
-    Bool horz_found = False;
-    Bool vert_found = False;
-    Bool list_changed = False;
-    if (!XGetWindowProperty(display, c->window, net_atom[NetWMState], 0, LONG_MAX, False, XA_ATOM,
-                            &actualType, &format, &num_items, &bytes_after, (unsigned char **)&states) == Success)
-        return;
-
-    if (!states)
-        return;
-
-    Atom *atoms = (Atom *)malloc(sizeof(Atom) * num_items + 2);
-    int new_num_atoms = 0;
-
-    for (unsigned long i = 0; i < num_items; i++) {
-        if (states[i] == net_atom[NetWMStateMaximizedHorz] || states[i] == net_atom[NetWMStateMaximizedVert]) {
-            if (!set_maximized) {
-                list_changed = True;
-                continue;
-            }
-            if (states[i] == net_atom[NetWMStateMaximizedHorz]) {
-                horz_found = True;
-            } else if (states[i] == net_atom[NetWMStateMaximizedVert]) {
-                vert_found = True;
-            }
-            atoms[new_num_atoms++] = states[i];
-        }
-    }
+    unsigned int state = client_net_state(c);
+    Atom atoms[sizeof(net_state_atoms) / sizeof(net_state_atoms[0])];
+    int n = 0;
 
-    XFree(states);
+    client_snapshot(c);
+    if (state == c->net_state)
+        return;
 
-    if (set_maximized) {
-        if (horz_found == False) {
-            atoms[new_num_atoms++] = net_atom[NetWMStateMaximizedHorz];
-            list_changed = true;
-        }
-        if (vert_found == False) {
-            atoms[new_num_atoms++] = net_atom[NetWMStateMaximizedVert];
-            list_changed = True;
-        }
+    if ((state ^ c->net_state) & (NetStateHidden | NetStateUnwritten)) {
+        long data[2];
+        data[0] = c->hidden ? IconicState : NormalState;
+        data[1] = None; // icon window
+        XChangeProperty(display, c->window, wm_atom[WMState], wm_atom[WMState], 32, PropModeReplace,
+                        (unsigned char *)data, 2);
     }
 
-    if (list_changed) {
-        XChangeProperty(display, c->window, net_atom[NetWMStateMaximizedVert], XA_ATOM, 32,
-                        PropModeReplace, (unsigned char *)atoms, new_num_atoms);
-    }
+    for (size_t i = 0; i < sizeof(net_state_atoms) / sizeof(net_state_atoms[0]); i++)
+        if (state & (1u << i))
+            atoms[n++] = net_atom[net_state_atoms[i]];
+    XChangeProperty(display, c->window, net_atom[NetWMState], XA_ATOM, 32, PropModeReplace,
+                    (unsigned char *)atoms, n);
+    c->net_state = state;
+}
+
+// The net_state bits of an atom, 0 for states berry does not know
+static unsigned int net_state_bit(Atom atom) {
+    for (size_t i = 0; i < sizeof(net_state_atoms) / sizeof(net_state_atoms[0]); i++)
+        if (atom != None && atom == net_atom[net_state_atoms[i]])
+            return 1u << i;
+    return 0;
+}
+
+/* Apply a _NET_WM_STATE request for the given bits, action being one of
+ * _NET_WM_STATE_REMOVE, _ADD or _TOGGLE. Hidden is berry's to decide. */
+static void client_change_state(client *c, long action, unsigned int bits) {
+    unsigned int state = client_net_state(c), want;
+
+    if (action == _NET_WM_STATE_ADD)
+        want = state | bits;
+    else if (action == _NET_WM_STATE_REMOVE)
+        want = state & ~bits;
+    else if (action == _NET_WM_STATE_TOGGLE)
+        want = state ^ bits;
+    else
+        return;
+    unsigned int changed = (state ^ want) & ~NetStateHidden;
 
-    free(atoms);
+    if (changed & NetStateFullscreen) {
+        LOGN("Recieved fullscreen request");
+        client_fullscreen(c, false, want & NetStateFullscreen, true);
+    }
+    // one of the two maximized states is enough for berry's monocle
+    if (changed & (NetStateMaximizedVert | NetStateMaximizedHorz) &&
+        c->mono != ((want & (NetStateMaximizedVert | NetStateMaximizedHorz)) != 0))
+        client_monocle(c);
+    if (changed & (NetStateAbove | NetStateBelow)) {
+        c->layer = want & NetStateAbove ? LayerAbove : want & NetStateBelow ? LayerBelow : LayerNormal;
+        stack_dirty();
+    }
+    if (changed & NetStateSticky)
+        c->sticky = want & NetStateSticky;
+    if (changed & NetStateDemandsAttention)
+        c->attention = (want & NetStateDemandsAttention) && c != f_client;
+    client_update_state(c);
 }
 
 static void handle_expose(XEvent *e) {
@@ -953,9 +1431,15 @@ static void handle_expose(XEvent *e) {
         LOGN("Expose event client not found");
         return;
     }
-    LOGN("expose client: focusing");
+    if (ev->count > 0)
+        return; // repaint once for the whole batch
+
+    // the buffer still holds the title unless the frame changed since
     focused = c == f_client;
-    draw_text(c, focused);
+    if (c->title_w == MAX(get_actual_width(c), MINIMUM_DIM) && c->title_h == top_height(c))
+        draw_present(c);
+    else
+        draw_text(c, focused);
 }
 
 static void handle_focus(XEvent *e) {
@@ -977,10 +1461,10 @@ static void handle_property_notify(XEvent *e) {
     if (ev->state == PropertyDelete)
         return;
 
-    if (ev->atom == net_atom[NetWMName]) {
-        client_set_title(c);
-        draw_text(c, c == f_client);
-    }
+    if (ev->atom == net_atom[NetWMName])
+        client_fetch(c, FetchTitle);
+    else if (ev->atom == wm_atom[WMProtocols])
+        client_fetch(c, FetchProtocols);
 }
 
 static void handle_configure_notify(XEvent *e) {
@@ -989,7 +1473,7 @@ static void handle_configure_notify(XEvent *e) {
     if (c != NULL) {
         int cx = left_width(c);
         int cy = top_height(c);
-        if (c->window == ev->window) {
+        if (c->window == ev->window && c->reparented) {
             // LOGP("configure for client %s from XSendEvent", ev->send_event ? "is" : "is NOT");
             // LOGP("configure for client override_redirect is %d", ev->override_redirect ? "True" : "False");
             if (ev->x != cx || ev->y != cy) {
@@ -1004,73 +1488,164 @@ static void handle_configure_notify(XEvent *e) {
         LOGN("Handling configure notify event for root window");
         display_width = ev->width;
         display_height = ev->height;
-        monitors_free();
-        monitors_setup();
+        monitors_changed = true;
+    }
+}
+
+// Queued ConfigureRequests for the window arg points to
+static Bool configure_request_event(Display *dpy, XEvent *e, XPointer arg) {
+    UNUSED(dpy);
+    return e->type == ConfigureRequest && e->xconfigurerequest.window == *(Window *)arg;
+}
+
+/* Count requests per client and second. A client past CONFIGURE_RATE_MAX is most
+ * likely answering each of our ConfigureNotifys with a new request, it is only
+ * told its geometry until the second is over. What it asked for last is applied
+ * then, see configure_check. */
+static bool client_configure_throttled(client *c, unsigned int requests) {
+    long now = time_us();
+    if (now - c->configure_since >= 1000000) {
+        c->configure_since = now;
+        c->configure_count = 0;
+    }
+
+    bool was_throttled = c->configure_count > CONFIGURE_RATE_MAX;
+    c->configure_count += requests;
+    if (!was_throttled && c->configure_count > CONFIGURE_RATE_MAX)
+        fprintf(stderr, "berry: 0x%lx sent more than %d configure requests in a second, throttling it\n",
+                c->window, CONFIGURE_RATE_MAX);
+    return c->configure_count > CONFIGURE_RATE_MAX;
+}
+
+/* Apply the requests throttled clients held back once their second is over.
+ * Returns the ms until the next one is due, -1 if none is held. */
+static int configure_check(void) {
+    long now = time_us(), next = -1;
+
+    if (configures_held == 0)
+        return -1;
+
+    for (struct workspace *w = ws_used; w != NULL; w = w->next) {
+        for (client *c = w->c_list; c != NULL; c = c->next) {
+            if (!c->configure_held)
+                continue;
+            long left = c->configure_since + 1000000 - now;
+            if (left > 0) {
+                if (next == -1 || left < next)
+                    next = left;
+                continue;
+            }
+            c->configure_held = false;
+            configures_held--;
+            c->configure_since = now;
+            c->configure_count = 1;
+            LOGP("Applying the request 0x%lx sent while throttled", c->window);
+            if (c->fullscreen)
+                client_notify_move(c);
+            else
+                client_configure(c, &c->configure_last);
+        }
     }
+    return next == -1 ? -1 : (int)((next + 999) / 1000);
 }
 
 static void handle_configure_request(XEvent *e) {
-    client *c;
     XConfigureRequestEvent *ev = &e->xconfigurerequest;
-    XWindowChanges wc;
+    client *c = get_client_from_window(ev->window);
+    unsigned int requests = 1;
+    XEvent later;
 
-    LOGN("Handling configure request event");
-
-    if (ev->value_mask & CWX)
-        wc.x = ev->x;
-    if (ev->value_mask & CWY)
-        wc.y = ev->y;
-    if (ev->value_mask & CWWidth)
-        wc.width = ev->width;
-    if (ev->value_mask & CWHeight)
-        wc.height = ev->height;
-    if (ev->value_mask & CWBorderWidth)
-        wc.border_width = ev->border_width;
-    if (ev->value_mask & CWSibling)
-        wc.sibling = ev->above;
-    if (ev->value_mask & CWStackMode)
-        wc.stack_mode = ev->detail;
-    XConfigureWindow(display, ev->window, ev->value_mask, &wc); // Seems noisy because it makes a new configure.  This causes the window to be reconfigured to the last size when it was closed. Not sure how that works.
-    c = get_client_from_window(ev->window);
+    // only the latest geometry matters, take every request already queued for the window at once
+    while (XCheckIfEvent(display, &later, configure_request_event, (XPointer)&ev->window)) {
+        events_merge_configure(ev, &later.xconfigurerequest);
+        requests++;
+    }
+    LOGP("Handling %u configure request(s) for 0x%lx", requests, ev->window);
 
-    if (c != NULL) {
-        if (c->fullscreen)
-            return;
+    if (c == NULL) {
+        XWindowChanges wc = { ev->x, ev->y, ev->width, ev->height, ev->border_width, ev->above, ev->detail };
+        XConfigureWindow(display, ev->window, ev->value_mask, &wc);
+        return;
+    }
 
-        if (ev->value_mask & (CWX | CWY)) {
-            client_move_relative(c,
-                                 wc.x - get_actual_x(c) - 2 * left_width(c),
-                                 wc.y - get_actual_y(c) - 2 * top_height(c));
-        }
-        if (ev->value_mask & (CWWidth | CWHeight)) {
-            client_resize_relative(c,
-                                   wc.width - get_actual_width(c) + 2 * get_dec_width(c),
-                                   wc.height - get_actual_height(c) + 2 * get_dec_height(c));
-        }
-        if (ev->value_mask & CWStackMode && ev->detail == Above) {
-            if (c->hidden) {
-                client_show(c);
-            }
+    /* Managed clients are moved and resized through their frame and never
+     * configured verbatim. Requests that change nothing, come from a fullscreen
+     * client or a throttled one only get a synthetic ConfigureNotify, which
+     * ICCCM asks for when a request is not granted. */
+    if (c->fullscreen) {
+        client_notify_move(c);
+        return;
+    }
+    if (client_configure_throttled(c, requests)) {
+        // the last size a client asks for in a burst is often the one it keeps
+        if (!c->configure_held) {
+            c->configure_last = *ev;
+            c->configure_held = true;
+            configures_held++;
+        } else {
+            events_merge_configure(&c->configure_last, ev);
         }
+        client_notify_move(c);
+        return;
+    }
+    if (c->configure_held) {
+        // the second ended before configure_check came around, the new request wins where both set a field
+        events_merge_configure(&c->configure_last, ev);
+        c->configure_held = false;
+        configures_held--;
+        ev = &c->configure_last;
+    }
+    client_configure(c, ev);
+}
 
-        client_refresh(c); // why?  We just resized. Does this prevent orphaned decoration windows?
-    } else {
-        LOGN("Window for configure was not found");
+// Move and resize a client as a ConfigureRequest asks, through its frame
+static void client_configure(client *c, XConfigureRequestEvent *ev) {
+    if (ev->value_mask & CWStackMode && ev->detail == Above && c->hidden)
+        client_show(c);
+
+    int x = ev->value_mask & CWX ? ev->x : c->geom.x;
+    int y = ev->value_mask & CWY ? ev->y : c->geom.y;
+    int w = ev->value_mask & CWWidth ? ev->width : c->geom.width;
+    int h = ev->value_mask & CWHeight ? ev->height : c->geom.height;
+    if (c->geom.x >= display_width) {
+        // off screen with its workspace or hidden, the position applies once it is back
+        if (ev->value_mask & CWX)
+            c->x_hide = x;
+        x = c->geom.x;
+    }
+
+    if (x != c->geom.x || y != c->geom.y)
+        client_move_absolute(c, x, y);
+    if (w != c->geom.width || h != c->geom.height) {
+        client_resize_absolute(c, w, h);
+        client_notify_move(c);
+    } else if (x == c->geom.x && y == c->geom.y) {
+        client_notify_move(c);
     }
 }
 
 static void handle_map_request(XEvent *e) {
-    static XWindowAttributes wa;
     XMapRequestEvent *ev = &e->xmaprequest;
+    struct worker_msg m = { .job = WorkerManage, .window = ev->window };
 
     /*LOGN("Handling map request event");*/
 
-    if (!XGetWindowAttributes(display, ev->window, &wa))
+    // the window's properties are read on the worker, see manage_fetched
+    if (worker_post(&m))
         return;
-    if (wa.override_redirect)
+    worker_run(display, &m);
+    manage_fetched(&m);
+}
+
+// Manage a window that asked to be mapped once its properties are read
+static void manage_fetched(struct worker_msg *m) {
+    XWindowAttributes wa;
+
+    // gone or grabbed by someone else meanwhile
+    if (!XGetWindowAttributes(display, m->window, &wa) || wa.override_redirect)
         return;
 
-    manage_new_window(ev->window, &wa);
+    manage_new_window(m->window, &wa, NULL, m, false);
 }
 
 static void handle_destroy_notify(XEvent *e) {
@@ -1078,6 +1653,8 @@ static void handle_destroy_notify(XEvent *e) {
     client *c = get_client_from_window(ev->window);
     if (c != NULL) {
         LOGP("e: destroy %x (%s)", (int)ev->window, c == NULL ? "other" : (c->window == ev->window ? "client" : "decoration"));
+    } else {
+        stack_dock_remove(ev->window);
     }
     client_unmanage(c);
 }
@@ -1087,7 +1664,7 @@ static void handle_reparent_notify(XEvent *e) {
     client *c = get_client_from_window(ev->window);
     LOGP("e: reparent %x (%s)", (int)ev->window, c == NULL ? "other" : (c->window == ev->window ? "client" : "decoration"));
     if (c != NULL) {
-        if (ev->parent != c->dec) {
+        if (ev->parent != (c->reparented ? c->dec : root)) {
             LOGN("window was reparented out of its decoration. Unmanaging it.");
             client_unmanage(c);
         }
@@ -1103,10 +1680,11 @@ static void handle_unmap_notify(XEvent *e) {
          * They close slowing, causing focusing issues with unmap requests. Check to see if the current
          * workspace is empty and, if so, focus the root client so that we can pick up new key presses..
          */
-        if (f_list[curr_ws] == NULL) {
+        if (ws_focus(curr_ws) == NULL) {
             client_manage_focus(NULL);
         }
 
+        stack_dock_remove(ev->window);
         window_find_struts();
         return;
     }
@@ -1127,7 +1705,7 @@ static void client_unmanage(client *c) {
          * They close slowing, causing focusing issues with unmap requests. Check to see if the current
          * workspace is empty and, if so, focus the root client so that we can pick up new key presses..
          */
-        if (f_list[curr_ws] == NULL) {
+        if (ws_focus(curr_ws) == NULL) {
             LOGN("Client not found while deleting and ws is empty, focusing root window");
             client_manage_focus(NULL);
         } else {
@@ -1138,37 +1716,99 @@ static void client_unmanage(client *c) {
         return;
     }
 
+    unsigned long requests = XNextRequest(display);
+    long start = time_us();
     int border = conf.b_width + conf.i_width;
     XSelectInput(display, c->dec, NoEventMask); // stop any further event notifications
     XSelectInput(display, c->window, NoEventMask);
     XUnmapWindow(display, c->dec);                                                                     // this is a bit too late and picom will fade out only the decorations
-    XReparentWindow(display, c->window, root, c->geom.x + border, c->geom.y + border + conf.t_height); // why do we need to do this?
+    if (c->reparented)
+        XReparentWindow(display, c->window, root, c->geom.x + border, c->geom.y + border + conf.t_height); // why do we need to do this?
     LOGP("destroying decoration 0x%x", (unsigned int)c->dec);
     XDestroyWindow(display, c->dec);
+    if (c->title_draw != NULL)
+        XftDrawDestroy(c->title_draw);
+    if (c->title_buf != None)
+        XFreePixmap(display, c->title_buf);
+    stack_forget(client_frame(c));
+    if (client_beside_frame(c))
+        stack_forget(c->window);
+    snapshot_remove(c->window);
+    if (c->ping_sent != 0 && !c->hung)
+        pings_waiting--;
+    if (c->term_sent != 0)
+        terms_waiting--;
+    if (c->configure_held)
+        configures_held--;
+    for (struct workspace *w = ws_used; w != NULL; w = w->next)
+        for (client *tmp = w->c_list; tmp != NULL; tmp = tmp->next)
+            if (tmp->transient == c)
+                tmp->transient = NULL;
+    ipc_broadcast(IpcEventMap, "unmap 0x%lx", c->window);
+    ws_layout_dirty(c->ws);
+    LOGP("Unmanaged 0x%lx %s with %lu requests in %ld us", c->window,
+         c->reparented ? "reparented" : "beside its frame", XNextRequest(display) - requests, time_us() - start);
     client_delete(c);
     free(c);
     client_raise(f_client);
 }
 
+/* Focus follows the pointer once it rests on a client for conf.hover_delay ms.
+ * Crossings from grabs, from moving between a frame and its client and from
+ * berry's own restacking and workspace switches are not the pointer arriving. */
 static void handle_enter_notify(XEvent *e) {
     XEnterWindowEvent *ev = &e->xcrossing;
 
-    client *c;
-
-    if (!conf.follow_pointer)
+    if (!conf.follow_pointer || alt_tabbing || ev->mode != NotifyNormal || ev->detail == NotifyInferior ||
+        (long)(ev->serial - crossing_serial) <= 0)
         return;
 
-    c = get_client_from_window(ev->window);
+    client *c = get_client_from_window(ev->window);
+    hover_window = c != NULL && c != f_client ? c->window : None;
+    hover_due = time_us() + conf.hover_delay * 1000L;
+    if (conf.hover_delay == 0)
+        hover_check();
+}
 
-    if (c != NULL && c != f_client) {
-        bool warp_pointer;
-        warp_pointer = conf.warp_pointer;
-        conf.warp_pointer = false;
-        client_manage_focus(c);
-        if (c->ws != curr_ws)
-            switch_ws(c->ws);
-        conf.warp_pointer = warp_pointer;
-    }
+// Focus the hovered client once its delay is over. Returns the ms left, -1 if none is pending.
+static int hover_check(void) {
+    Window root_return, child;
+    int rx, ry, wx, wy;
+    unsigned int mask;
+
+    if (hover_window == None)
+        return -1;
+
+    long left = hover_due - time_us();
+    if (left > 0)
+        return (int)((left + 999) / 1000);
+
+    client *c = get_client_from_window(hover_window);
+    hover_window = None;
+    // leaving for the bare desktop reports no crossing, so ask where the pointer is now
+    if (c == NULL || c == f_client || alt_tabbing ||
+        !XQueryPointer(display, root, &root_return, &child, &rx, &ry, &wx, &wy, &mask) ||
+        (child != c->window && child != client_frame(c)))
+        return -1;
+
+    LOGP("Pointer rests on 0x%lx, focusing it", c->window);
+    bool warp_pointer = conf.warp_pointer;
+    conf.warp_pointer = false;
+    client_manage_focus(c);
+    if (c->ws != curr_ws)
+        switch_ws(c->ws);
+    conf.warp_pointer = warp_pointer;
+    return -1;
+}
+
+/* Windows moving under the pointer cross it too. Crossings carry the serial of the
+ * request that caused them, so the ones up to now are ours. The NoOp makes sure a
+ * later real crossing carries a newer serial. */
+static void crossings_ignore(void) {
+    if (!conf.follow_pointer)
+        return;
+    crossing_serial = NextRequest(display) - 1;
+    XNoOp(display);
 }
 
 /* Hides the given Client by moving it outside of the visible display */
@@ -1185,14 +1825,23 @@ static void client_hide(client *c) {
 }
 
 static void load_config(char *conf_path) {
-    if (fork() == 0) {
-        setsid();
-        execl("/bin/sh", "sh", conf_path, NULL);
-        LOGP("CONFIG PATH: %s", conf_path);
-    }
+    struct worker_msg m = { .job = WorkerShell };
+    snprintf(m.text, sizeof(m.text), "%s", conf_path);
+    if (!worker_post(&m))
+        worker_run(display, &m);
+    LOGP("CONFIG PATH: %s", conf_path);
 }
 
 static void client_manage_focus(client *c) {
+    client *prev = f_client;
+
+    // any focus change ends a pending alt-tab
+    if (alt_tab_shown != NULL && alt_tab_shown != c && alt_tab_shown != f_client) {
+        client_set_color(alt_tab_shown, conf.iu_color, conf.bu_color);
+        draw_text(alt_tab_shown, false);
+    }
+    alt_tab_sel = alt_tab_shown = NULL;
+
     if (c != NULL && f_client != NULL) {
         client_set_color(f_client, conf.iu_color, conf.bu_color);
         draw_text(f_client, false);
@@ -1204,6 +1853,7 @@ static void client_manage_focus(client *c) {
         draw_text(c, true);
         client_raise(c);
         client_set_input(c);
+        client_ping(c); // notice a hung client as soon as it is used
         if (conf.warp_pointer)
             warp_pointer(c);
         if (c->hidden) {
@@ -1211,18 +1861,32 @@ static void client_manage_focus(client *c) {
         }
         ewmh_set_focus(c);
         manage_xsend_icccm(c, wm_atom[WMTakeFocus]);
+        if (c->attention) {
+            c->attention = false;
+            client_update_state(c);
+        }
 
         if (c->ws != curr_ws)
             switch_ws(c->ws);
 
         f_client = c;
-        reorder_focus();
+        if (ws_focus(c->ws) != c) {
+            focus_ring_remove(ws_get(c->ws), c);
+            focus_ring_push(ws_get(c->ws), c);
+        }
     } else { // client is null, might happen when switching to a new workspace
              //  without any active clients
         //LOGN("Giving focus to dummy window");
         f_client = NULL;
         XSetInputFocus(display, nofocus, RevertToPointerRoot, CurrentTime);
     }
+
+    if (f_client != prev) {
+        if (f_client != NULL)
+            ipc_broadcast(IpcEventFocus, "focus 0x%lx", f_client->window);
+        else
+            ipc_broadcast(IpcEventFocus, "focus none");
+    }
 }
 
 static void grab_button_modifiers(unsigned int button, unsigned int modifiers, Window window) {
@@ -1232,40 +1896,43 @@ static void grab_button_modifiers(unsigned int button, unsigned int modifiers, W
     }
 }
 
-static void manage_new_window(Window w, XWindowAttributes *wa) {
-    /* Credits to vain for XGWP checking */
-    Atom prop, da;
-    unsigned char *prop_ret = NULL;
-    int di;
-    unsigned long dl;
-    if (XGetWindowProperty(display, w, net_atom[NetWMWindowType], 0,
-                           sizeof(Atom), False, XA_ATOM, &da, &di, &dl, &dl,
-                           &prop_ret) == Success) {
-        if (prop_ret) {
-            prop = ((Atom *)prop_ret)[0];
-            if ((prop == net_atom[NetWMWindowTypeDock] && !conf.manage[Dock]) ||
-                (prop == net_atom[NetWMWindowTypeToolbar] && !conf.manage[Toolbar]) ||
-                (prop == net_atom[NetWMWindowTypeUtility] && !conf.manage[Utility]) ||
-                (prop == net_atom[NetWMWindowTypeDialog] && !conf.manage[Dialog]) ||
-                (prop == net_atom[NetWMWindowTypeMenu] && !conf.manage[Menu]) ||
-                (prop == net_atom[NetWMWindowTypePopupMenu]) ||
-                (prop == net_atom[NetWMWindowTypeDropdownMenu]) ||
-                (prop == net_atom[NetWMWindowTypeTooltip]) ||
-                (prop == net_atom[NetWMWindowTypeNotification]) ||
-                (prop == net_atom[NetWMWindowTypeCombo]) ||
-                (prop == net_atom[NetWMWindowTypeDND])) {
-                XMapWindow(display, w);
-                LOGN("Window is of type dock, toolbar, utility, menu, or splash: not managing");
-                LOGN("Mapping new window, not managed");
-                window_find_struts();
-                return;
-            }
-        }
+/* Manage w with the properties a WorkerManage job read, which are read right
+ * away when props is NULL. Only windows adopted at startup, already mapped
+ * when berry came up, get their snapshot back, as X reuses window ids. */
+static void manage_new_window(Window w, XWindowAttributes *wa, const struct handover *h, const struct worker_msg *props,
+                              bool adopting) {
+    struct worker_msg fetched = { .job = WorkerManage, .window = w };
+    unsigned long requests = XNextRequest(display);
+    long start = time_us();
+
+    if (props == NULL) {
+        worker_run(display, &fetched);
+        props = &fetched;
+    }
+    Atom prop = props->value[ManageType];
+    if ((prop == net_atom[NetWMWindowTypeDock] && !conf.manage[Dock]) ||
+        (prop == net_atom[NetWMWindowTypeToolbar] && !conf.manage[Toolbar]) ||
+        (prop == net_atom[NetWMWindowTypeUtility] && !conf.manage[Utility]) ||
+        (prop == net_atom[NetWMWindowTypeDialog] && !conf.manage[Dialog]) ||
+        (prop == net_atom[NetWMWindowTypeMenu] && !conf.manage[Menu]) ||
+        (prop == net_atom[NetWMWindowTypePopupMenu]) ||
+        (prop == net_atom[NetWMWindowTypeDropdownMenu]) ||
+        (prop == net_atom[NetWMWindowTypeTooltip]) ||
+        (prop == net_atom[NetWMWindowTypeNotification]) ||
+        (prop == net_atom[NetWMWindowTypeCombo]) ||
+        (prop == net_atom[NetWMWindowTypeDND])) {
+        XMapWindow(display, w);
+        LOGN("Window is of type dock, toolbar, utility, menu, or splash: not managing");
+        LOGN("Mapping new window, not managed");
+        if (prop == net_atom[NetWMWindowTypeDock])
+            stack_dock_add(w);
+        window_find_struts();
+        return;
     }
 
     // Make sure we aren't trying to map the same window twice
-    for (int i = 0; i < WORKSPACE_NUMBER; i++) {
-        for (client *tmp = c_list[i]; tmp; tmp = tmp->next) {
+    for (struct workspace *ws = ws_used; ws != NULL; ws = ws->next) {
+        for (client *tmp = ws->c_list; tmp; tmp = tmp->next) {
             if (tmp->window == w) {
                 LOGN("Error, window already mapped. Not mapping.");
                 return;
@@ -1273,19 +1940,6 @@ static void manage_new_window(Window w, XWindowAttributes *wa) {
         }
     }
 
-    // Get class information for the current window
-    XClassHint ch;
-    bool has_class_hint = false;
-    if (XGetClassHint(display, w, &ch)) {
-        LOGP("client has class %s", ch.res_class);
-        LOGP("client has name %s", ch.res_name);
-        if (ch.res_class)
-            XFree(ch.res_class);
-        if (ch.res_name)
-            XFree(ch.res_name);
-        has_class_hint = true;
-    }
-
     client *c;
     c = malloc(sizeof(client));
     if (c == NULL) {
@@ -1293,8 +1947,27 @@ static void manage_new_window(Window w, XWindowAttributes *wa) {
         return;
     }
     c->window = w;
-    c->class_hint = has_class_hint;
+    c->class_hint = props->value[ManageFlags] & ManageClassHint;
     c->ws = curr_ws;
+    c->order = client_order++;
+    c->dec = None;
+    c->raised = ++raise_seq;
+    c->transient = NULL;
+    c->shape_w = c->shape_h = 0;
+    c->shape_r = 0;
+    c->dec_color = conf.if_color;
+    c->title_buf = None;
+    c->title_draw = NULL;
+    c->title_buf_w = c->title_buf_h = 0;
+    c->title_w = c->title_h = 0;
+    if (props->value[ManageTransient] != None)
+        c->transient = get_client_from_window(props->value[ManageTransient]);
+    if (prop == net_atom[NetWMWindowTypeDesktop])
+        c->layer = LayerDesktop;
+    else if (prop == net_atom[NetWMWindowTypeDock])
+        c->layer = LayerAbove;
+    else
+        c->layer = LayerNormal;
     c->geom.x = wa->x;
     c->geom.y = wa->y;
     c->geom.width = wa->width;
@@ -1303,8 +1976,46 @@ static void manage_new_window(Window w, XWindowAttributes *wa) {
     c->fullscreen = false;
     c->mono = false;
     c->was_fs = false;
-    c->decorated = !window_is_undecorated(w);
+    c->decorated = !(props->value[ManageFlags] & ManageUndecorated);
     c->prev = c->geom; // just in case we get fullscreen requests, we want this to be initialized to something reasonable
+    c->snapshot_dirty = false;
+    c->protocols = ProtocolsKnown;
+    for (int i = 0; i < props->count; i++)
+        c->protocols |= protocol_bit(props->value[ManageAtoms + i]);
+    c->fetch_busy = c->fetch_stale = 0;
+    c->ping_sent = 0;
+    c->hung = false;
+    c->term_sent = 0;
+    c->configure_since = 0;
+    c->configure_count = 0;
+    c->configure_held = false;
+    c->reparented = h != NULL ? h->reparented : conf.reparent;
+    c->sticky = c->attention = false;
+    c->net_state = NetStateUnwritten;
+    c->title[0] = '\0';
+
+    // a window berry managed before a restart goes back where it was
+    struct snapshot_state saved;
+    bool restored = false;
+    if (h != NULL) {
+        saved = h->state;
+        restored = true;
+        c->order = h->order;
+        c->raised = h->raised;
+        c->layer = h->layer;
+        c->x_hide = h->x_hide;
+        c->hidden = saved.flags & SnapshotHidden;
+        client_order = MAX(client_order, h->order + 1);
+        raise_seq = MAX(raise_seq, h->raised);
+    } else if (adopting) {
+        restored = snapshot_get(w, &saved);
+    }
+    if (restored) {
+        if (saved.ws >= 0 && saved.ws < ws_count)
+            c->ws = saved.ws;
+        c->geom = saved.geom;
+        c->prev = saved.prev;
+    }
 
     XSetWindowBorderWidth(display, c->window, 0);
 
@@ -1313,7 +2024,9 @@ static void manage_new_window(Window w, XWindowAttributes *wa) {
     grab_button_modifiers(AnyButton, 0, c->window);
 
 #if 1
-    if (conf.decorate) {
+    if (h != NULL && h->frame != None) {
+        client_decorations_adopt(c, h->frame);
+    } else if (conf.decorate) {
         if (c->class_hint) {
             LOGN("Decorating window");
             client_decorations_create(c);
@@ -1326,47 +2039,91 @@ static void manage_new_window(Window w, XWindowAttributes *wa) {
         client_decorations_create(c);
 #endif
 
-    client_set_title(c);
+    // reparented windows survive berry exiting or crashing
+    XAddToSaveSet(display, c->window);
+
+    client_fetch(c, FetchTitle);
     client_refresh(c); /* using our current factoring, w/h are set incorrectly */
-    client_save(c, curr_ws);
-    client_place(c);
+    stack_track(client_frame(c), c->dec != None && (h == NULL || h->frame == None));
+    if (client_beside_frame(c))
+        stack_track(c->window, h == NULL || h->frame == None); // created right above the frame
+    client_save(c, c->ws);
+    if (restored) {
+        if (!(saved.flags & SnapshotDecorated) && c->decorated)
+            client_decorations_destroy(c);
+        c->was_fs = saved.flags & SnapshotWasFs;
+        c->mono = saved.flags & SnapshotMono;
+        if (saved.flags & SnapshotFullscreen) {
+            c->fullscreen = true;
+            client_shape(c);
+            stack_dirty();
+        }
+    } else {
+        client_place(c);
+    }
+    ws_layout_dirty(c->ws);
     ewmh_set_desktop(c, c->ws);
     ewmh_set_client_list();
 
     // not sure we need this when parenting to decoration
     XMapWindow(display, c->window);
     XMapWindow(display, c->dec);
+    ipc_broadcast(IpcEventMap, "map 0x%lx %d", c->window, c->ws);
     // XFlush(display); // show window with decorations immediately
     // XSelectInput(display, c->window, EnterWindowMask|FocusChangeMask|PropertyChangeMask|StructureNotifyMask);
-    XSelectInput(display, c->window, StructureNotifyMask | PropertyChangeMask); // unmapnotify for removing clients, propertynotify for setting title
+    // unmapnotify for removing clients, propertynotify for setting title, enternotify for focus follows pointer
+    XSelectInput(display, c->window, StructureNotifyMask | PropertyChangeMask | (conf.follow_pointer ? EnterWindowMask : 0));
     // XSelectInput(display, c->dec, SubstructureRedirectMask);
     // XSetWMProtocols(display, c->window, &wm_atom[WMDeleteWindow], 1); // no this is wrong
     XSetWMProtocols(display, c->dec, &wm_atom[WMDeleteWindow], 1);
     XGrabButton(display, conf.move_button, conf.move_mask, c->window, True, ButtonPressMask | ButtonReleaseMask | PointerMotionMask, GrabModeAsync, GrabModeAsync, None, None);
     XGrabButton(display, conf.resize_button, conf.resize_mask, c->window, True, ButtonPressMask | ButtonReleaseMask | PointerMotionMask, GrabModeAsync, GrabModeAsync, None, None);
 
-    if (f_client)
-        f_last_client = f_client;
-    client_manage_focus(c);
+    // handed over clients are still on or off screen where the old berry left them
+    if (h == NULL && restored && saved.flags & SnapshotHidden) {
+        client_hide(c);
+    } else if (h == NULL && c->ws != curr_ws && !safe_to_focus(c->ws)) {
+        client_hide(c); // off screen with its workspace, but not hidden itself
+        c->hidden = false;
+    }
+
+    // a restart restores the focus once every client is back, see handover_adopt
+    if (h == NULL && !c->hidden && c->ws == curr_ws)
+        client_manage_focus(c);
+
+    // states asked for before mapping, berry's own ones came with the snapshot or handover
+    unsigned int state = 0;
+    for (int i = 0; i < props->count; i++)
+        state |= net_state_bit(props->value[ManageAtoms + i]);
+    c->sticky = state & NetStateSticky;
+    c->attention = state & NetStateDemandsAttention && c != f_client;
+    if (h == NULL && state & (NetStateAbove | NetStateBelow)) {
+        c->layer = state & NetStateAbove ? LayerAbove : LayerBelow;
+        stack_dirty();
+    }
+    if (!restored && state & NetStateFullscreen)
+        client_fullscreen(c, false, true, true);
     client_update_state(c);
 
     LOGP("new window: 0x%x dec: 0x%x", (unsigned int)c->window, (unsigned int)c->dec);
+    LOGP("Managed 0x%lx %s with %lu requests in %ld us", c->window,
+         c->reparented ? "reparented" : "beside its frame", XNextRequest(display) - requests, time_us() - start);
 }
 
 static int manage_xsend_icccm(client *c, Atom atom) {
     /* This is from a dwm patch by Brendan MacDonell:
      * http://lists.suckless.org/dev/1104/7548.html */
 
-    int n;
-    Atom *protocols;
     int exists = 0;
     XEvent ev;
 
-    if (XGetWMProtocols(display, c->window, &protocols, &n)) {
-        while (!exists && n--)
-            exists = protocols[n] == atom;
-        XFree(protocols);
-    }
+    // WM_PROTOCOLS is read when the client maps and whenever it changes
+    if (atom == wm_atom[WMDeleteWindow])
+        exists = c->protocols & ProtocolDelete;
+    else if (atom == wm_atom[WMTakeFocus])
+        exists = c->protocols & ProtocolTakeFocus;
+    else if (atom == net_atom[NetWMPing])
+        exists = c->protocols & ProtocolPing;
 
     if (exists) {
         ev.type = ClientMessage;
@@ -1375,6 +2132,7 @@ static int manage_xsend_icccm(client *c, Atom atom) {
         ev.xclient.format = 32;
         ev.xclient.data.l[0] = atom;
         ev.xclient.data.l[1] = CurrentTime;
+        ev.xclient.data.l[2] = c->window; // _NET_WM_PING sends it back
         XSendEvent(display, c->window, True, NoEventMask, &ev);
     }
 
@@ -1386,12 +2144,16 @@ static void client_move_absolute(client *c, int x, int y) {
 
     c->geom.x = x;
     c->geom.y = y;
+    if (client_beside_frame(c))
+        client_follow_frame(c);
 
     if (c->mono) {
         c->mono = false;
     }
 
     client_notify_move(c);
+    client_snapshot(c);
+    ipc_broadcast(IpcEventGeometry, "geometry 0x%lx %d %d %d %d", c->window, x, y, c->geom.width, c->geom.height);
 }
 
 static void client_notify_move(client *c) {
@@ -1419,105 +2181,496 @@ static void client_move_relative(client *c, int x, int y) {
 }
 
 static void client_move_to_front(client *c) {
-    int ws;
-    ws = c->ws;
+    struct workspace *w = ws_get(c->ws);
 
     /* If we didn't find the client */
-    if (ws == -1)
+    if (w == NULL)
         return;
 
     /* If the Client is at the front of the list, ignore command */
-    if (c_list[ws] == c || c_list[ws]->next == NULL)
+    if (w->c_list == c || w->c_list->next == NULL)
         return;
 
     client *tmp;
-    for (tmp = c_list[ws]; tmp->next != NULL; tmp = tmp->next)
+    for (tmp = w->c_list; tmp->next != NULL; tmp = tmp->next)
         if (tmp->next == c)
             break;
 
     if (tmp && tmp->next)
         tmp->next = tmp->next->next; /* remove the Client from the list */
-    c->next = c_list[ws];            /* add the client to the front of the list */
-    c_list[ws] = c;
+    c->next = w->c_list;             /* add the client to the front of the list */
+    w->c_list = c;
 }
 
 static void client_monocle(client *c) {
     XEvent ev;
     memset(&ev, 0, sizeof ev);
 
-    int mon = ws_m_list[c->ws];
+    int mon = ws_monitor(c->ws);
 
     if (c->mono) {
         client_move_absolute(c, c->prev.x, c->prev.y);
         client_resize_absolute(c, c->prev.width, c->prev.height);
         ev.xclient.data.l[0] = _NET_WM_STATE_REMOVE;
         c->mono = false;
+        client_shape(c);
     } else {
         c->prev = c->geom;
         client_move_absolute(c, m_list[mon].x + left_width(c) + conf.left_gap, m_list[mon].y + top_height(c) + conf.top_gap);
         client_resize_absolute(c, m_list[mon].width - conf.right_gap - conf.left_gap - get_dec_width(c), m_list[mon].height - conf.top_gap - conf.bot_gap - get_dec_height(c));
         ev.xclient.data.l[0] = _NET_WM_STATE_ADD;
         c->mono = true;
+        client_shape(c);
     }
 
     client_update_state(c);
 }
 
+// Put a new client where it overlaps the visible clients of its workspace the least
 static void client_place(client *c) {
-    client_center(c);
-    return;
+    static struct client_geom *frames = NULL;
+    static int frames_cap = 0;
+    int count = 0, x, y;
+    long start = time_us();
+
+    if (ws_get(c->ws) != NULL && ws_get(c->ws)->layout != LayoutFloat)
+        return; // tiled by ws_layout_apply once mapped
+
+    if (!conf.smart_place) {
+        client_center(c);
+        return;
+    }
+
+    for (client *tmp = ws_clients(c->ws); tmp != NULL; tmp = tmp->next) {
+        if (tmp == c || tmp->hidden)
+            continue;
+        if (count == frames_cap) {
+            int cap = frames_cap ? frames_cap * 2 : 32;
+            struct client_geom *tmp_frames = realloc(frames, cap * sizeof(struct client_geom));
+            if (tmp_frames == NULL)
+                break;
+            frames = tmp_frames;
+            frames_cap = cap;
+        }
+        frames[count++] = (struct client_geom){ tmp->geom.x - left_width(tmp), tmp->geom.y - top_height(tmp),
+                                                tmp->geom.width + get_dec_width(tmp), tmp->geom.height + get_dec_height(tmp) };
+    }
+
+    int mon = ws_monitor(c->ws);
+    struct client_geom area = { m_list[mon].x + conf.left_gap, m_list[mon].y + conf.top_gap,
+                                m_list[mon].width - conf.left_gap - conf.right_gap,
+                                m_list[mon].height - conf.top_gap - conf.bot_gap };
+
+    if (!place_find(&area, frames, count, c->geom.width + get_dec_width(c), c->geom.height + get_dec_height(c),
+                    PLACE_RES, &x, &y)) {
+        client_center(c);
+        return;
+    }
+
+    client_move_absolute(c, x + left_width(c), y + top_height(c));
+    LOGP("Placed client at %d,%d among %d clients in %ld us", x, y, count, time_us() - start);
 }
 
 static void client_raise(client *c) {
     if (c != NULL) {
         client_move_to_front(c);
-        if (c->dec)
-            XRaiseWindow(display, c->dec ? c->dec : c->window);
+        c->raised = ++raise_seq;
+        stack_dirty();
     }
 }
 
-static void monitors_setup(void) {
-    XineramaScreenInfo *m_info;
-    int n;
+// The window berry stacks for a client, its decoration if it has one
+static Window client_frame(client *c) {
+    return c->dec != None ? c->dec : c->window;
+}
 
-    if (!XineramaIsActive(display)) {
-        LOGN("Xinerama not active, cannot read monitors");
+static void stack_dirty(void) {
+    restack_pending = true;
+}
+
+struct stack_entry {
+    Window frame, window; /* window is None for docks */
+    int layer, depth;
+    unsigned long root_raised, raised;
+    bool beside; /* window goes right above frame, see client_beside_frame */
+};
+
+// Bottom to top: layer, then the parent a transient belongs to, then transients
+// above their parents, then the most recently raised on top. qsort is not stable,
+// so the frame breaks ties, docks included, and each restack gives the same order.
+static int stack_entry_cmp(const void *a, const void *b) {
+    const struct stack_entry *x = a, *y = b;
+    if (x->layer != y->layer)
+        return x->layer < y->layer ? -1 : 1;
+    if (x->root_raised != y->root_raised)
+        return x->root_raised < y->root_raised ? -1 : 1;
+    if (x->depth != y->depth)
+        return x->depth < y->depth ? -1 : 1;
+    if (x->raised != y->raised)
+        return x->raised < y->raised ? -1 : 1;
+    if (x->frame != y->frame)
+        return x->frame < y->frame ? -1 : 1;
+    return 0;
+}
+
+static int client_layer(client *c) {
+    return c->fullscreen ? LayerFullscreen : c->layer;
+}
+
+static bool stack_reserve(Window **list, size_t *cap, size_t need) {
+    if (need <= *cap)
+        return true;
+
+    size_t grow = *cap ? *cap : 64;
+    while (grow < need)
+        grow *= 2;
+
+    Window *tmp = realloc(*list, grow * sizeof(Window));
+    if (tmp == NULL)
+        return false;
+    *list = tmp;
+    *cap = grow;
+    return true;
+}
+
+// A frame berry just created sits on top of the server's stack, anything else
+// is at an unknown position until the next full restack
+static void stack_track(Window w, bool created) {
+    if (!created || !stack_reserve(&stack_applied, &stack_applied_cap, stack_applied_len + 1)) {
+        stack_resync = true;
+    } else {
+        memmove(stack_applied + 1, stack_applied, stack_applied_len * sizeof(Window));
+        stack_applied[0] = w;
+        stack_applied_len++;
+    }
+    stack_members = true;
+    stack_dirty();
+}
+
+// Removing a window keeps the relative order of the rest, nothing to restack
+static void stack_forget(Window w) {
+    for (size_t i = 0; i < stack_applied_len; i++) {
+        if (stack_applied[i] == w) {
+            memmove(stack_applied + i, stack_applied + i + 1, (stack_applied_len - i - 1) * sizeof(Window));
+            stack_applied_len--;
+            break;
+        }
+    }
+    stack_members = true;
+    stack_dirty();
+}
+
+static void stack_dock_add(Window w) {
+    for (size_t i = 0; i < dock_count; i++)
+        if (docks[i] == w)
+            return;
+
+    if (!stack_reserve(&docks, &dock_cap, dock_count + 1))
         return;
+    docks[dock_count++] = w;
+    stack_track(w, false);
+}
+
+static void stack_dock_remove(Window w) {
+    for (size_t i = 0; i < dock_count; i++) {
+        if (docks[i] == w) {
+            docks[i] = docks[--dock_count];
+            stack_forget(w);
+            return;
+        }
     }
+}
 
-    m_info = XineramaQueryScreens(display, &n);
-    if (m_info == NULL) {
-        LOGN("Xinerama could not query screens");
+/* Sort every frame by layer and send the part of the order that differs from the
+ * last one applied. XRestackWindows leaves its first window in place, so the
+ * window just above the changed range anchors it. Only when the top itself
+ * changes is it raised first. */
+static void stack_apply(void) {
+    static struct stack_entry *entries = NULL;
+    static Window *want = NULL, *stacking = NULL;
+    static size_t entries_cap = 0, want_cap = 0, stacking_cap = 0;
+    size_t n = 0, m = 0, clients = 0;
+
+    restack_pending = false;
+
+    for (struct workspace *w = ws_used; w != NULL; w = w->next)
+        for (client *c = w->c_list; c != NULL; c = c->next)
+            n++;
+    n += dock_count;
+
+    if (n > entries_cap) {
+        struct stack_entry *tmp = realloc(entries, n * sizeof(struct stack_entry));
+        if (tmp == NULL)
+            return;
+        entries = tmp;
+        entries_cap = n;
+    }
+    // a client beside its frame is stacked on its own, at most two windows per entry
+    if (!stack_reserve(&want, &want_cap, 2 * n) || !stack_reserve(&stacking, &stacking_cap, n))
         return;
+
+    n = 0;
+    for (struct workspace *w = ws_used; w != NULL; w = w->next) {
+        for (client *c = w->c_list; c != NULL; c = c->next) {
+            struct stack_entry *e = &entries[n++];
+            client *top = c;
+            e->depth = 0;
+            // the depth limit guards against WM_TRANSIENT_FOR loops
+            while (top->transient != NULL && e->depth < 8) {
+                top = top->transient;
+                e->depth++;
+            }
+            e->frame = client_frame(c);
+            e->window = c->window;
+            e->layer = MAX(client_layer(c), client_layer(top));
+            e->root_raised = top->raised;
+            e->raised = c->raised;
+            e->beside = client_beside_frame(c);
+        }
     }
-    LOGP("Found %d screens active", n);
-    m_count = n;
+    for (size_t i = 0; i < dock_count; i++)
+        entries[n++] = (struct stack_entry){ docks[i], None, LayerAbove, 0, 0, 0, false };
+
+    qsort(entries, n, sizeof(struct stack_entry), stack_entry_cmp);
+
+    for (size_t i = 0; i < n; i++)
+        m += entries[i].beside ? 2 : 1;
+    for (size_t i = 0, k = m; i < n; i++) {
+        want[--k] = entries[i].frame;
+        if (entries[i].beside)
+            want[--k] = entries[i].window;
+        if (entries[i].window != None)
+            stacking[clients++] = entries[i].window;
+    }
+
+    size_t first = 0, last = m;
+    if (!stack_resync && stack_applied_len == m) {
+        while (first < m && want[first] == stack_applied[first])
+            first++;
+        while (last > first && want[last - 1] == stack_applied[last - 1])
+            last--;
+        if (first == m && !stack_members)
+            return;
+    }
+
+    if (first < last) {
+        if (first == 0)
+            XRaiseWindow(display, want[0]);
+        else
+            first--;
+        if (last - first > 1)
+            XRestackWindows(display, want + first, last - first);
+        LOGP("Restacked %zu of %zu windows", last - first, m);
+        crossings_ignore();
+    }
+
+    if (stack_reserve(&stack_applied, &stack_applied_cap, m)) {
+        memcpy(stack_applied, want, m * sizeof(Window));
+        stack_applied_len = m;
+        stack_resync = false;
+    }
+    stack_members = false;
+
+    XChangeProperty(display, root, net_atom[NetClientListStacking], XA_WINDOW, 32, PropModeReplace,
+                    (unsigned char *)stacking, clients);
+}
+
+static bool monitor_equal(const struct monitor *a, const struct monitor *b) {
+    return a->x == b->x && a->y == b->y && a->width == b->width && a->height == b->height;
+}
+
+static void monitors_setup(void) {
+    XineramaScreenInfo *m_info = NULL;
+    int n = 0;
 
-    /* First, we need to decide which monitors are unique.
-     * Non-unique monitors can become a problem when displays
-     * are mirrored. They will share the same information (which something
-     * like xrandr will handle for us) but will have the exact same information.
-     * We want to avoid creating duplicate structs for the same monitor if we dont
-     * need to
-     */
+    if (XineramaIsActive(display))
+        m_info = XineramaQueryScreens(display, &n);
+    else
+        LOGN("Xinerama not active, cannot read monitors");
 
-    // TODO: Add support for repeated displays
+    if (m_info == NULL || n == 0) {
+        // treat the whole display as one monitor so that m_list is always usable
+        m_list = malloc(sizeof(struct monitor));
+        m_list[0] = (struct monitor){ 0, 0, display_width, display_height, 0 };
+        m_count = 1;
+        if (m_info != NULL)
+            XFree(m_info);
+        ewmh_set_viewport();
+        return;
+    }
+    LOGP("Found %d screens active", n);
 
+    /* Mirrored outputs are reported as separate screens with the exact same
+     * geometry, keep only the first of them so that they share one monitor */
     m_list = malloc(sizeof(struct monitor) * n);
+    m_count = 0;
 
     for (int i = 0; i < n; i++) {
-        m_list[i].screen = m_info[i].screen_number;
-        m_list[i].width = m_info[i].width;
-        m_list[i].height = m_info[i].height;
-        m_list[i].x = m_info[i].x_org;
-        m_list[i].y = m_info[i].y_org;
-        LOGP("Screen #%d with dim: x=%d y=%d w=%d h=%d",
-             m_list[i].screen, m_list[i].x, m_list[i].y, m_list[i].width, m_list[i].height);
+        struct monitor m = { m_info[i].x_org, m_info[i].y_org, m_info[i].width, m_info[i].height, m_info[i].screen_number };
+        bool mirrored = false;
+        for (int j = 0; j < m_count && !mirrored; j++)
+            mirrored = monitor_equal(&m_list[j], &m);
+
+        if (mirrored) {
+            LOGP("Screen #%d mirrors another screen, skipping", m.screen);
+            continue;
+        }
+
+        m_list[m_count++] = m;
+        LOGP("Screen #%d with dim: x=%d y=%d w=%d h=%d", m.screen, m.x, m.y, m.width, m.height);
     }
 
+    XFree(m_info);
     ewmh_set_viewport();
 }
 
+// The new monitor that best replaces an old one: itself if it still exists,
+// else the one covering most of it, else the closest
+static int monitor_successor(const struct monitor *old) {
+    long best_area = -1, best_dist = LONG_MAX;
+    int best = 0;
+
+    for (int i = 0; i < m_count; i++) {
+        const struct monitor *m = &m_list[i];
+        if (monitor_equal(m, old))
+            return i;
+
+        long w = MIN(m->x + m->width, old->x + old->width) - MAX(m->x, old->x);
+        long h = MIN(m->y + m->height, old->y + old->height) - MAX(m->y, old->y);
+        long area = (w > 0 && h > 0) ? w * h : 0;
+        long dx = (m->x + m->width / 2) - (old->x + old->width / 2);
+        long dy = (m->y + m->height / 2) - (old->y + old->height / 2);
+        long dist = dx * dx + dy * dy;
+
+        if (area > best_area || (area == best_area && dist < best_dist)) {
+            best = i;
+            best_area = area;
+            best_dist = dist;
+        }
+    }
+
+    return best;
+}
+
+// Index of the old monitor holding the center of a client, or -1
+static int client_old_monitor(client *c, const struct monitor *old, int old_count, bool parked) {
+    int x = (parked ? c->x_hide : c->geom.x) + c->geom.width / 2;
+    int y = c->geom.y + c->geom.height / 2;
+
+    for (int i = 0; i < old_count; i++) {
+        if (x >= old[i].x && x < old[i].x + old[i].width && y >= old[i].y && y < old[i].y + old[i].height)
+            return i;
+    }
+
+    return -1;
+}
+
+/* Re-read the monitors after RandR or root geometry changes. Only workspaces
+ * and clients on monitors that changed are touched, all of the resulting
+ * requests go out together with the next flush. */
+static void monitors_update(void) {
+    struct monitor *old = m_list;
+    int old_count = m_count;
+
+    monitors_changed = false;
+    m_list = NULL;
+    monitors_setup();
+
+    bool same = old_count == m_count;
+    for (int i = 0; i < old_count && same; i++)
+        same = monitor_equal(&old[i], &m_list[i]);
+    if (same) {
+        LOGN("Monitor layout unchanged");
+        free(old);
+        return;
+    }
+
+    int *successor = malloc(sizeof(int) * old_count);
+    for (int i = 0; i < old_count; i++) {
+        successor[i] = monitor_successor(&old[i]);
+        LOGP("Monitor %d -> %d%s", i, successor[i], monitor_equal(&old[i], &m_list[successor[i]]) ? "" : " (changed)");
+    }
+
+    // unoccupied workspaces move along too, so a client sent there lands on the right monitor
+    int ws_old[WORKSPACE_MAX];
+    for (int i = 0; i < ws_count; i++) {
+        ws_old[i] = (ws_mon[i] >= 0 && ws_mon[i] < old_count) ? ws_mon[i] : 0;
+        ws_mon[i] = successor[ws_old[i]];
+    }
+
+    // clients parked past the old display, hidden or on a workspace not shown, have their x in x_hide
+    int old_right = 0;
+    for (int i = 0; i < old_count; i++)
+        old_right = MAX(old_right, old[i].x + old[i].width);
+
+    for (struct workspace *w = ws_used; w != NULL; w = w->next) {
+        int ws_mon_old = ws_old[w->id];
+        ws_layout_dirty(w->id);
+
+        for (client *c = w->c_list; c != NULL; c = c->next) {
+            bool parked = c->hidden || c->geom.x >= old_right;
+            int from = client_old_monitor(c, old, old_count, parked);
+            if (from == -1)
+                from = ws_mon_old;
+
+            const struct monitor *to = &m_list[successor[from]];
+            if (!monitor_equal(&old[from], to))
+                client_remap_monitor(c, &old[from], to, parked);
+            else if (parked)
+                client_move_absolute(c, display_width + 100, c->geom.y); // keep it past the grown display
+        }
+    }
+
+    free(successor);
+    free(old);
+    window_find_struts();
+}
+
+// Keep a client at the same place relative to its monitor after the monitor
+// moved or changed size, shrinking it to fit if needed. A parked client stays
+// off screen, its x_hide follows the monitor.
+static void client_remap_monitor(client *c, const struct monitor *from, const struct monitor *to, bool parked) {
+    bool mono = c->mono;
+    int x, y, w, h;
+
+    if (c->fullscreen && conf.fs_max) {
+        x = to->x;
+        y = to->y;
+        w = to->width;
+        h = to->height;
+    } else if (mono) {
+        x = to->x + left_width(c) + conf.left_gap;
+        y = to->y + top_height(c) + conf.top_gap;
+        w = to->width - conf.right_gap - conf.left_gap - get_dec_width(c);
+        h = to->height - conf.top_gap - conf.bot_gap - get_dec_height(c);
+    } else {
+        w = MIN(c->geom.width, to->width - get_dec_width(c));
+        h = MIN(c->geom.height, to->height - get_dec_height(c));
+        x = to->x + (parked ? c->x_hide : c->geom.x) - from->x;
+        y = to->y + c->geom.y - from->y;
+        x = MAX(to->x + left_width(c), MIN(x, to->x + to->width - w - get_dec_width(c) + left_width(c)));
+        y = MAX(to->y + top_height(c), MIN(y, to->y + to->height - h - get_dec_height(c) + top_height(c)));
+    }
+
+    // geometry to restore from fullscreen or monocle follows the monitor as well
+    if (c->fullscreen || mono) {
+        c->prev.x += to->x - from->x;
+        c->prev.y += to->y - from->y;
+    }
+
+    LOGP("Moving client 0x%x to %d,%d %dx%d", (unsigned int)c->window, x, y, w, h);
+    if (w != c->geom.width || h != c->geom.height)
+        client_resize_absolute(c, w, h);
+
+    if (parked) {
+        c->x_hide = x;
+        client_move_absolute(c, display_width + 100, y);
+    } else {
+        client_move_absolute(c, x, y);
+    }
+    c->mono = mono; // moving clears mono
+}
+
 static void client_refresh(client *c) {
     bool mono = c->mono;
     LOGN("Refreshing client");
@@ -1528,32 +2681,60 @@ static void client_refresh(client *c) {
     c->mono = mono; // moving can clear mono
 }
 
-static void refresh_config(void) {
-    for (int i = 0; i < WORKSPACE_NUMBER; i++) {
-        for (client *tmp = c_list[i]; tmp != NULL; tmp = tmp->next) {
-            if (conf.decorate) {
-                XWindowChanges wc;
-                wc.border_width = conf.b_width;
-                XConfigureWindow(display, tmp->dec, CWBorderWidth, &wc);
-            }
+// Apply a config change to the workspaces on screen, the others catch up in switch_ws
+static void refresh_config(unsigned int dirty) {
+    for (struct workspace *w = ws_used; w != NULL; w = w->next) {
+        if (ws_shown(w))
+            ws_refresh(w, dirty);
+        else
+            w->dirty |= dirty;
+    }
+}
+
+static void ws_refresh(struct workspace *w, unsigned int dirty) {
+    dirty |= w->dirty;
+    w->dirty = 0;
+    if (!dirty)
+        return;
 
+    LOGP("Refreshing workspace %d (0x%x)", w->id, dirty);
+    for (client *tmp = w->c_list; tmp != NULL; tmp = tmp->next) {
+        if (dirty & ConfigColors) {
             if (f_client != tmp)
                 client_set_color(tmp, conf.iu_color, conf.bu_color);
             else
                 client_set_color(tmp, conf.if_color, conf.bf_color);
+        }
 
-            client_refresh(tmp);
-            client_show(tmp);
-
-            if (i != curr_ws) {
-                client_hide(tmp);
-            } else {
-                // if we raise the client it will reorder the list and this for loop never ends
-                //client_show(tmp);
-                //client_raise(tmp);
+        if (dirty & ConfigGeometry) {
+            if (tmp->decorated) {
+                XWindowChanges wc;
+                wc.border_width = conf.b_width;
+                XConfigureWindow(display, tmp->dec, CWBorderWidth, &wc);
             }
+            client_refresh(tmp); // redraws the title as well
+        } else if (dirty & (ConfigColors | ConfigTitle)) {
+            draw_text(tmp, f_client == tmp);
         }
+
+        if (dirty & ConfigShape)
+            client_shape(tmp);
     }
+
+    if (dirty & (ConfigGeometry | ConfigLayout) && w->layout != LayoutFloat)
+        ws_layout_apply(w);
+}
+
+// Clients moved off a workspace take its pending config changes with them
+static void ws_merge_dirty(int ws, unsigned int dirty) {
+    struct workspace *w = ws_get(ws);
+    if (w == NULL || !dirty)
+        return;
+
+    if (w->id == curr_ws)
+        ws_refresh(w, dirty);
+    else
+        w->dirty |= dirty;
 }
 
 static void client_resize_absolute(client *c, int w, int h) {
@@ -1567,13 +2748,19 @@ static void client_resize_absolute(client *c, int w, int h) {
 
     /*LOGN("Resizing client main window");*/
 
-    XResizeWindow(display, c->window, MAX(w, MINIMUM_DIM), MAX(h, MINIMUM_DIM));
     XResizeWindow(display, c->dec, MAX(dec_w, MINIMUM_DIM), MAX(dec_h, MINIMUM_DIM));
+    if (client_beside_frame(c))
+        client_follow_frame(c);
+    else
+        XResizeWindow(display, c->window, MAX(w, MINIMUM_DIM), MAX(h, MINIMUM_DIM));
 
     if (c->mono)
         c->mono = false;
+    client_shape(c);
+    client_snapshot(c);
 
     draw_text(c, f_client == c);
+    ipc_broadcast(IpcEventGeometry, "geometry 0x%lx %d %d %d %d", c->window, c->geom.x, c->geom.y, w, h);
 }
 
 static void client_resize_relative(client *c, int w, int h) {
@@ -1581,13 +2768,16 @@ static void client_resize_relative(client *c, int w, int h) {
 }
 
 static void client_save(client *c, int ws) {
+    struct workspace *w = ws_acquire(ws);
+    if (w == NULL)
+        return;
+
     /* Save the client to the "stack" of managed clients */
-    c->next = c_list[ws];
-    c_list[ws] = c;
+    c->next = w->c_list;
+    w->c_list = c;
 
     /* Save the client o the list of focusing order */
-    c->f_next = f_list[ws];
-    f_list[ws] = c;
+    focus_ring_push(w, c);
 
     ewmh_set_client_list();
 }
@@ -1596,13 +2786,13 @@ static void client_save(client *c, int ws) {
  * based on the currently focused workspaces on each monitor.
  */
 static bool safe_to_focus(int ws) {
-    int mon = ws_m_list[ws];
+    int mon = ws_monitor(ws);
 
     if (m_count == 1)
         return false;
 
-    for (int i = 0; i < WORKSPACE_NUMBER; i++)
-        if (i != ws && ws_m_list[i] == mon && c_list[i] != NULL && c_list[i]->hidden == false)
+    for (struct workspace *w = ws_used; w != NULL; w = w->next)
+        if (w->id != ws && ws_mon[w->id] == mon && w->c_list != NULL && w->c_list->hidden == false)
             return false;
 
     LOGN("Workspace is safe to focus");
@@ -1611,13 +2801,18 @@ static bool safe_to_focus(int ws) {
 
 static void client_send_to_ws(client *c, int ws) {
     int prev, mon_next, mon_prev, x_off, y_off;
-    mon_next = ws_m_list[ws];
-    mon_prev = ws_m_list[c->ws];
+    mon_next = ws_monitor(ws);
+    mon_prev = ws_monitor(c->ws);
+    unsigned int dirty = ws_get(c->ws)->dirty;
     client_delete(c);
     prev = c->ws;
     c->ws = ws;
     client_save(c, ws);
-    focus_next(f_list[prev]);
+    ws_merge_dirty(ws, dirty);
+    ws_layout_dirty(prev);
+    ws_layout_dirty(ws);
+    if (ws_focus(prev) != NULL)
+        client_manage_focus(ws_focus(prev));
 
     x_off = c->geom.x - m_list[mon_prev].x;
     y_off = c->geom.y - m_list[mon_prev].y;
@@ -1631,11 +2826,392 @@ static void client_send_to_ws(client *c, int ws) {
     }
 
     ewmh_set_desktop(c, ws);
+    ipc_broadcast(IpcEventWorkspace, "send 0x%lx %d", c->window, ws);
+}
+
+struct shape_mask {
+    int width, height;
+    unsigned int radius;
+    Pixmap mask; /* None while the slot is free */
+    unsigned long used;
+};
+
+static struct shape_mask shape_cache[SHAPE_CACHE_SIZE];
+static GC shape_gc = None;
+
+/* Build or look up the 1-bit mask of a rounded rectangle. Frames share a handful
+ * of sizes (tiled cells, defaults, maximized), so a small LRU cache spares
+ * redrawing the arcs on every resize. */
+static Pixmap shape_mask_get(int width, int height, unsigned int radius) {
+    static unsigned long clock = 0;
+    struct shape_mask *slot = &shape_cache[0];
+
+    for (int i = 0; i < SHAPE_CACHE_SIZE; i++) {
+        struct shape_mask *m = &shape_cache[i];
+        if (m->mask != None && m->width == width && m->height == height && m->radius == radius) {
+            m->used = ++clock;
+            return m->mask;
+        }
+        if (slot->mask != None && (m->mask == None || m->used < slot->used))
+            slot = m;
+    }
+
+    if (slot->mask != None)
+        XFreePixmap(display, slot->mask);
+    slot->mask = XCreatePixmap(display, root, width, height, 1);
+    slot->width = width;
+    slot->height = height;
+    slot->radius = radius;
+    slot->used = ++clock;
+    if (shape_gc == None)
+        shape_gc = XCreateGC(display, slot->mask, 0, NULL);
+
+    int r = MIN(radius, (unsigned int)MIN(width, height) / 2), d = 2 * r;
+    XSetForeground(display, shape_gc, 0);
+    XFillRectangle(display, slot->mask, shape_gc, 0, 0, width, height);
+    XSetForeground(display, shape_gc, 1);
+    XFillRectangle(display, slot->mask, shape_gc, r, 0, width - d, height);
+    XFillRectangle(display, slot->mask, shape_gc, 0, r, width, height - d);
+    XFillArc(display, slot->mask, shape_gc, 0, 0, d, d, 0, 360 * 64);
+    XFillArc(display, slot->mask, shape_gc, width - d, 0, d, d, 0, 360 * 64);
+    XFillArc(display, slot->mask, shape_gc, 0, height - d, d, d, 0, 360 * 64);
+    XFillArc(display, slot->mask, shape_gc, width - d, height - d, d, d, 0, 360 * 64);
+    LOGP("Built %dx%d frame mask with radius %d", width, height, r);
+    return slot->mask;
+}
+
+static void shape_cache_free(void) {
+    for (int i = 0; i < SHAPE_CACHE_SIZE; i++) {
+        if (shape_cache[i].mask != None)
+            XFreePixmap(display, shape_cache[i].mask);
+        shape_cache[i].mask = None;
+    }
+    if (shape_gc != None)
+        XFreeGC(display, shape_gc);
+    shape_gc = None;
+}
+
+// Round the frame corners, only touching the shape when the frame size changed
+static void client_shape(client *c) {
+    if (!shape_supported || c->dec == None)
+        return;
+
+    if (conf.corner_radius == 0 || c->fullscreen || c->mono) {
+        if (c->shape_w != 0)
+            XShapeCombineMask(display, c->dec, ShapeBounding, 0, 0, None, ShapeSet);
+        c->shape_w = c->shape_h = 0;
+        return;
+    }
+
+    // the bounding shape is relative to the inside of the border
+    int bw = conf.b_width;
+    int w = MAX(get_actual_width(c), MINIMUM_DIM) + 2 * bw;
+    int h = MAX(get_actual_height(c), MINIMUM_DIM) + 2 * bw;
+    if (w == c->shape_w && h == c->shape_h && conf.corner_radius == c->shape_r)
+        return;
+
+    XShapeCombineMask(display, c->dec, ShapeBounding, -bw, -bw,
+                      shape_mask_get(w, h, conf.corner_radius), ShapeSet);
+    c->shape_w = w;
+    c->shape_h = h;
+    c->shape_r = conf.corner_radius;
+}
+
+// Note the client for the next snapshot_flush, state often changes several times per event
+static void client_snapshot(client *c) {
+    c->snapshot_dirty = true;
+    snapshot_pending = true;
+}
+
+static struct snapshot_state client_snapshot_state(client *c) {
+    struct snapshot_state s = { c->ws, c->geom, c->prev, 0 };
+    // clients off screen, minimized or on a hidden workspace, remember x in x_hide
+    if (c->geom.x >= display_width)
+        s.geom.x = c->x_hide;
+    s.flags = (c->hidden ? SnapshotHidden : 0) | (c->mono ? SnapshotMono : 0) |
+              (c->fullscreen ? SnapshotFullscreen : 0) | (c->decorated ? SnapshotDecorated : 0) |
+              (c->was_fs ? SnapshotWasFs : 0);
+    return s;
+}
+
+// Write the state of changed clients into the snapshot file
+static void snapshot_flush(void) {
+    snapshot_pending = false;
+    for (struct workspace *w = ws_used; w != NULL; w = w->next) {
+        for (client *c = w->c_list; c != NULL; c = c->next) {
+            if (!c->snapshot_dirty)
+                continue;
+            c->snapshot_dirty = false;
+
+            struct snapshot_state s = client_snapshot_state(c);
+            snapshot_put(c->window, &s);
+        }
+    }
+}
+
+static bool snapshot_keep(unsigned long window) {
+    return get_client_from_window(window) != NULL;
+}
+
+/* A frame whose berry exited after a restart outlives it, as RetainTemporary keeps
+ * every resource of that connection. Move its client back to the root window and
+ * manage it like any other window found at startup. */
+static void frame_unwrap(Window frame, XWindowAttributes *fa) {
+    Window root_return, parent_return, *children;
+    unsigned int count;
+
+    if (!XQueryTree(display, frame, &root_return, &parent_return, &children, &count))
+        return;
+
+    LOGP("Unwrapping frame 0x%lx left behind by a restart", frame);
+    for (unsigned int i = 0; i < count; i++) {
+        XWindowAttributes wa;
+        if (!XGetWindowAttributes(display, children[i], &wa))
+            continue;
+        XReparentWindow(display, children[i], root, fa->x + fa->border_width + wa.x,
+                        fa->y + fa->border_width + wa.y);
+        // the window is mapped again on the root right away, manage it as if it asked
+        if (XGetWindowAttributes(display, children[i], &wa) && !wa.override_redirect)
+            manage_new_window(children[i], &wa, NULL, NULL, true);
+    }
+    if (children)
+        XFree(children);
+    XDestroyWindow(display, frame);
+}
+
+/* Put a client back on the root window where it is shown and destroy its frame.
+ * Closing the display would not do it for frames handed over by a restart, as
+ * they belong to the retained connection of the berry that made them. */
+static void client_release(client *c) {
+    // off screen clients, minimized or on a hidden workspace, come back at x_hide
+    int x = c->geom.x >= display_width ? c->x_hide : c->geom.x;
+
+    if (c->reparented)
+        XReparentWindow(display, c->window, root, x + conf.b_width, c->geom.y + conf.b_width);
+    else if (x != c->geom.x)
+        XMoveWindow(display, c->window, x + conf.b_width, c->geom.y + conf.b_width);
+    if (c->dec != None)
+        XDestroyWindow(display, c->dec);
+}
+
+// Manage the windows already mapped when berry starts, e.g. after a restart
+static void adopt_windows(void) {
+    Window root_return, parent_return, *children;
+    unsigned int count;
+    int adopted = 0, unwrapped = 0;
+    long start = time_us();
+
+    if (!XQueryTree(display, root, &root_return, &parent_return, &children, &count))
+        return;
+
+    for (unsigned int i = 0; i < count; i++) {
+        XWindowAttributes wa;
+        unsigned char *prop_ret = NULL;
+        Atom da;
+        int di;
+        unsigned long nitems, dl;
+
+        // frames handed over by a restart are managed already
+        if (children[i] == check || children[i] == nofocus || get_client_from_window(children[i]) != NULL)
+            continue;
+        if (!XGetWindowAttributes(display, children[i], &wa) || wa.override_redirect || wa.map_state != IsViewable)
+            continue;
+        if (XGetWindowProperty(display, children[i], net_berry[BerryFrame], 0, 1, False, XA_WINDOW,
+                               &da, &di, &nitems, &dl, &prop_ret) == Success && prop_ret != NULL) {
+            XFree(prop_ret);
+            if (nitems > 0) {
+                frame_unwrap(children[i], &wa);
+                unwrapped++;
+                continue;
+            }
+        }
+        manage_new_window(children[i], &wa, NULL, NULL, true);
+        adopted++;
+    }
+    if (children)
+        XFree(children);
+    // the connections that held those frames are not needed by anyone now
+    if (unwrapped > 0)
+        XKillClient(display, AllTemporary);
+
+    // entries of windows that are gone would only match reused ids later
+    snapshot_prune(snapshot_keep);
+    snapshot_flush();
+    LOGP("Adopted %d windows in %ld us", adopted, time_us() - start);
+}
+
+static int handover_focus_cmp(const void *a, const void *b) {
+    return ((const struct handover *)b)->focus - ((const struct handover *)a)->focus;
+}
+
+// Read the header of a restart's state, before setup() sizes anything by it
+static void handover_begin(void) {
+    if (!restart_read(&handover, sizeof(handover)) || handover.version != HANDOVER_VERSION ||
+        handover.conf_size != sizeof(struct config) || handover.client_size != sizeof(struct handover)) {
+        LOGN("Restart state is from another berry version, starting fresh");
+        restart_end();
+        resuming = false;
+        return;
+    }
+
+    conf = handover.conf;
+    ws_count = MAX(1, MIN(handover.ws_count, WORKSPACE_MAX));
+    curr_ws = MIN(MAX(handover.curr_ws, 0), ws_count - 1);
+}
+
+// Take over the clients of the berry that restarted into this one
+static void handover_adopt(void) {
+    struct handover *list = NULL;
+    int n = 0, adopted = 0;
+    long start = time_us();
+
+    for (int i = 0; i < handover.workspaces; i++) {
+        int ws[2];
+        if (!restart_read(ws, sizeof(ws)))
+            break;
+        if (ws[0] >= 0 && ws[0] < ws_count && ws[1] >= 0 && ws[1] < LayoutLast && ws_acquire(ws[0]) != NULL)
+            ws_get(ws[0])->layout = ws[1];
+    }
+
+    if (handover.count > 0 && (list = malloc(handover.count * sizeof(struct handover))) != NULL)
+        while (n < handover.count && restart_read(&list[n], sizeof(struct handover)))
+            n++;
+    restart_end();
+
+    // client_save pushes to the front, so go backwards to keep the lists in order
+    for (int i = n - 1; i >= 0; i--) {
+        XWindowAttributes wa;
+        if (!XGetWindowAttributes(display, list[i].window, &wa)) {
+            // the client went away during the exec, nothing is left to frame
+            if (list[i].frame != None)
+                XDestroyWindow(display, list[i].frame);
+            continue;
+        }
+        manage_new_window(list[i].window, &wa, &list[i], NULL, true);
+        adopted++;
+    }
+
+    // rebuild the focus rings from the back, every push becomes the new head
+    if (n > 0)
+        qsort(list, n, sizeof(struct handover), handover_focus_cmp);
+    for (int i = 0; i < n; i++) {
+        client *c = get_client_from_window(list[i].window);
+        if (c == NULL || c->window != list[i].window)
+            continue;
+        focus_ring_remove(ws_get(c->ws), c);
+        focus_ring_push(ws_get(c->ws), c);
+    }
+    free(list);
+
+    // the pointer stays where it was, as if nothing happened
+    bool warp = conf.warp_pointer;
+    client *c = handover.focused != None ? get_client_from_window(handover.focused) : NULL;
+    conf.warp_pointer = false;
+    if (c != NULL && c->ws == curr_ws && !c->hidden)
+        client_manage_focus(c);
+    else if (ws_focus(curr_ws) != NULL)
+        client_manage_focus(ws_focus(curr_ws));
+    conf.warp_pointer = warp;
+    LOGP("Took over %d clients in %ld us", adopted, time_us() - start);
+}
+
+static int handover_focus_rank(struct workspace *w, client *c) {
+    int rank = 0;
+    for (client *f = w->f_list; f != c; f = f->f_next)
+        rank++;
+    return rank;
+}
+
+/* Exec a new berry that takes over every client. The frames stay alive across the
+ * exec because the connection closes with RetainTemporary, so nothing is
+ * reparented or redrawn from scratch. Everything else this connection owns is
+ * freed first, as retained resources are only reclaimed by a server reset.
+ * Returns only if the restart could not start, the caller shuts down instead. */
+static void handover_exec(char *argv[]) {
+    struct handover_header hdr = {
+        .version = HANDOVER_VERSION,
+        .conf_size = sizeof(struct config),
+        .client_size = sizeof(struct handover),
+        .curr_ws = curr_ws,
+        .ws_count = ws_count,
+        .focused = f_client != NULL ? f_client->window : None,
+        .conf = conf,
+    };
+    long start = time_us();
+
+    for (struct workspace *w = ws_used; w != NULL; w = w->next) {
+        hdr.workspaces++;
+        for (client *c = w->c_list; c != NULL; c = c->next)
+            hdr.count++;
+    }
+
+    if (access("/proc/self/exe", X_OK) < 0 || !restart_begin() || !restart_write(&hdr, sizeof(hdr))) {
+        LOGP("Could not restart: %s", strerror(errno));
+        restart_abort();
+        return;
+    }
+    for (struct workspace *w = ws_used; w != NULL; w = w->next) {
+        int ws[2] = { w->id, w->layout };
+        if (!restart_write(ws, sizeof(ws))) {
+            LOGP("Could not restart: %s", strerror(errno));
+            restart_abort();
+            return;
+        }
+    }
+    for (struct workspace *w = ws_used; w != NULL; w = w->next) {
+        for (client *c = w->c_list; c != NULL; c = c->next) {
+            struct handover h = { c->window, c->dec, client_snapshot_state(c), c->order,
+                                  c->raised, c->layer, c->x_hide, handover_focus_rank(w, c),
+                                  c->reparented };
+            h.state.geom.x = c->geom.x;
+            if (!restart_write(&h, sizeof(h))) {
+                LOGP("Could not restart: %s", strerror(errno));
+                restart_abort();
+                return;
+            }
+        }
+    }
+
+    for (struct workspace *w = ws_used; w != NULL; w = w->next) {
+        for (client *c = w->c_list; c != NULL; c = c->next) {
+            if (c->title_draw != NULL)
+                XftDrawDestroy(c->title_draw);
+            if (c->title_buf != None)
+                XFreePixmap(display, c->title_buf);
+        }
+    }
+    shape_cache_free();
+    if (font != NULL)
+        XftFontClose(display, font);
+    XftColorFree(display, DefaultVisual(display, screen), DefaultColormap(display, screen), &xft_focus_color);
+    XftColorFree(display, DefaultVisual(display, screen), DefaultColormap(display, screen), &xft_unfocus_color);
+    XftColorFree(display, DefaultVisual(display, screen), DefaultColormap(display, screen), &xft_hung_color);
+    XFreeGC(display, gc);
+    XUndefineCursor(display, root);
+    XFreeCursor(display, move_cursor);
+    XFreeCursor(display, normal_cursor);
+    // check_running in the new process must not find a dead check window
+    XDeleteProperty(display, root, net_atom[NetWMCheck]);
+    XDeleteProperty(display, root, net_atom[NetSupported]);
+    XDestroyWindow(display, check);
+    XDestroyWindow(display, nofocus);
+
+    XSetCloseDownMode(display, RetainTemporary);
+    worker_stop();
+    XCloseDisplay(display);
+    LOGP("Handing over %d clients after %ld us", hdr.count, time_us() - start);
+    restart_exec(argv);
+
+    // the frames are orphaned now, the next berry unwraps them, see frame_unwrap
+    fprintf(stderr, "berry: could not exec for restart: %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
 }
 
 static void client_set_color(client *c, unsigned long i_color, unsigned long b_color) {
     if (c->decorated) {
-        XSetWindowBackground(display, c->dec, i_color);
+        if (c->dec_color != i_color)
+            c->title_w = 0; // the buffered title has the old fill
+        c->dec_color = i_color;
         XSetWindowBorder(display, c->dec, b_color);
     }
 }
@@ -1644,45 +3220,266 @@ static void client_set_input(client *c) {
     XSetInputFocus(display, c->window, RevertToPointerRoot, CurrentTime);
 }
 
-static void client_set_title(client *c) {
-    XTextProperty tp;
-    char **slist = NULL;
-    int count;
+static enum worker_job fetch_job(unsigned char fetch) {
+    return fetch == FetchTitle ? WorkerTitle : WorkerProtocols;
+}
+
+// Read a property of c on the worker, a fetch already in flight is redone once it is back
+static void client_fetch(client *c, unsigned char fetch) {
+    struct worker_msg m = { .job = fetch_job(fetch), .window = c->window };
 
-    c->title[0] = 0;
-    if (!XGetTextProperty(display, c->window, &tp, net_atom[NetWMName])) {
-        LOGN("Could not read client title, not updating");
+    if (c->fetch_busy & fetch) {
+        c->fetch_stale |= fetch;
+        return;
+    }
+    if (worker_post(&m)) {
+        c->fetch_busy |= fetch;
         return;
     }
+    worker_run(display, &m);
+    client_fetched(c, &m);
+}
 
-    if (tp.encoding == XA_STRING) {
-        strncpy(c->title, (char *)tp.value, sizeof(c->title) - 1);
-    } else {
-        if (XmbTextPropertyToTextList(display, &tp, &slist, &count) >= Success && count > 0 && *slist) {
-            strncpy(c->title, slist[0], sizeof(c->title) - 1);
-            XFreeStringList(slist);
+static void client_fetched(client *c, struct worker_msg *m) {
+    if (m->job == WorkerTitle) {
+        if (!m->ok) {
+            LOGN("Could not read client title, not updating");
+            return;
+        }
+        memcpy(c->title, m->text, sizeof(c->title));
+        draw_text(c, c == f_client || c == alt_tab_shown);
+        ipc_broadcast(IpcEventTitle, "title 0x%lx %s", c->window, c->title);
+    } else if (m->job == WorkerProtocols) {
+        c->protocols = ProtocolsKnown;
+        for (int i = 0; i < m->count; i++)
+            c->protocols |= protocol_bit(m->value[i]);
+    }
+}
+
+// The client_protocols bit of a WM_PROTOCOLS atom, 0 for protocols berry does not speak
+static unsigned int protocol_bit(Atom atom) {
+    if (atom == None)
+        return 0;
+    if (atom == wm_atom[WMDeleteWindow])
+        return ProtocolDelete;
+    if (atom == wm_atom[WMTakeFocus])
+        return ProtocolTakeFocus;
+    if (atom == net_atom[NetWMPing])
+        return ProtocolPing;
+    return 0;
+}
+
+static unsigned int key_mod_index(unsigned int state) {
+    return (state & ShiftMask ? 1 : 0) | (state & ControlMask ? 2 : 0) |
+           (state & Mod1Mask ? 4 : 0) | (state & Mod4Mask ? 8 : 0);
+}
+
+static unsigned int key_index_mods(unsigned int index) {
+    return (index & 1 ? ShiftMask : 0) | (index & 2 ? ControlMask : 0) |
+           (index & 4 ? Mod1Mask : 0) | (index & 8 ? Mod4Mask : 0);
+}
+
+// Work out what a key does under exactly the given modifiers; only called while building key_table
+static key_action key_resolve(KeySym keysym, unsigned int state) {
+    key_action action = { KeyNone, 0 };
+
+    if (keysym == NoSymbol)
+        return action;
+
+    if (state == Mod4Mask) {
+        for (int i = 0; i < num_launchers; i++) {
+            if (launchers[i].keysym == keysym && launchers[i].file) {
+                action.type = KeyLaunch;
+                action.arg = i;
+                return action;
+            }
+        }
+        for (int i = 0; i < num_shortcuts; i++) {
+            if (shortcuts[i].keysym == keysym) {
+                action.type = KeyShortcut;
+                action.arg = i;
+                return action;
+            }
         }
     }
 
-    c->title[sizeof c->title - 1] = 0;
-    XFree(tp.value);
+    if ((state & ~ShiftMask) == Mod4Mask && keysym >= XK_1 && keysym <= XK_9 &&
+        keysym - XK_1 < (unsigned)ws_count) {
+        action.type = state & ShiftMask ? KeySendWs : KeySwitchWs;
+        action.arg = keysym - XK_1;
+    } else if ((state & ~ShiftMask) == Mod1Mask && keysym == XK_Tab) {
+        action.type = state & ShiftMask ? KeyFocusPrev : KeyFocusNext;
+    } else if (state == 0) {
+        for (int i = 0; i < num_nomod_launchers; i++) {
+            if (nomod_launchers[i].keysym == keysym && nomod_launchers[i].file) {
+                action.type = KeyNomodLaunch;
+                action.arg = i;
+                return action;
+            }
+        }
+    }
+
+    return action;
 }
 
-static void grab_super_key(int keycode, unsigned int modifiers, Window window) {
+static void key_grab(int keycode, unsigned int modifiers, bool grab) {
     unsigned int modmasks[] = { 0, Mod2Mask, LockMask, Mod2Mask | LockMask };
     for (unsigned int i = 0; i < sizeof(modmasks) / sizeof(modmasks[0]); i++) {
-        XGrabKey(display, keycode, modifiers | modmasks[i], window, True, GrabModeAsync, GrabModeAsync);
+        if (grab)
+            XGrabKey(display, keycode, modifiers | modmasks[i], root, True, GrabModeAsync, GrabModeAsync);
+        else
+            XUngrabKey(display, keycode, modifiers | modmasks[i], root);
     }
 }
 
+// Rebuild key_table from the current XKB keymap and adjust grabs for keycodes whose bindings moved
+static void keys_refresh(void) {
+    XkbDescPtr xkb = XkbGetMap(display, XkbKeySymsMask, XkbUseCoreKbd);
+    if (xkb == NULL) {
+        LOGN("Could not read keyboard map");
+        return;
+    }
+
+    super_l_keycode = super_r_keycode = 0;
+    memset(key_table, 0, sizeof(key_table));
+
+    for (int kc = xkb->min_key_code; kc <= xkb->max_key_code; kc++) {
+        KeySym keysym = XkbKeyNumGroups(xkb, kc) ? XkbKeySymEntry(xkb, kc, 0, 0) : NoSymbol;
+        uint16_t grabs = 0;
+
+        if (keysym == XK_Super_L && !super_l_keycode)
+            super_l_keycode = kc;
+        else if (keysym == XK_Super_R && !super_r_keycode)
+            super_r_keycode = kc;
+
+        // grab exactly the combinations that have an action
+        for (unsigned int m = 0; m < KEY_MODS; m++) {
+            key_table[kc][m] = key_resolve(keysym, key_index_mods(m));
+            if (key_table[kc][m].type != KeyNone)
+                grabs |= 1u << m;
+        }
+
+        // only touch the grabs that changed
+        uint16_t changed = grabs ^ key_grabs[kc];
+        for (unsigned int m = 0; m < KEY_MODS; m++) {
+            if (changed & (1u << m))
+                key_grab(kc, key_index_mods(m), grabs & (1u << m));
+        }
+        key_grabs[kc] = grabs;
+    }
+
+    XkbFreeKeyboard(xkb, 0, True);
+    LOGN("Rebuilt key table");
+}
+
+// With XKB the same change also comes as XkbMapNotify, which rebuilds the keys once
+static void handle_mapping_notify(XEvent *e) {
+    XMappingEvent *ev = &e->xmapping;
+    XRefreshKeyboardMapping(ev);
+    if (xkb_event_base == -1 && (ev->request == MappingKeyboard || ev->request == MappingModifier))
+        keys_refresh();
+}
+
+// Modifier changes are seen here without grabbing the modifier keys: releasing alt
+// ends alt-tab, and a super press and release with nothing in between is a tap.
+static void handle_modifier_state(XkbStateNotifyEvent *ev) {
+    if (alt_tabbing && !(ev->mods & Mod1Mask))
+        focus_commit();
+
+    if (ev->keycode == 0 || (ev->keycode != super_l_keycode && ev->keycode != super_r_keycode))
+        return;
+
+    bool *only_pressed = ev->keycode == super_l_keycode ? &super_l_only_pressed : &super_r_only_pressed;
+    if (ev->event_type == KeyPress) {
+        *only_pressed = true;
+    } else if (ev->event_type == KeyRelease) {
+        if (*only_pressed) {
+            LOGN("super tapped");
+            spawn(super_tap_launcher.file, super_tap_launcher.argv);
+        }
+        *only_pressed = false;
+    }
+}
+
+static void handle_xkb_event(XEvent *e) {
+    XkbEvent *ev = (XkbEvent *)e;
+    switch (ev->any.xkb_type) {
+    case XkbMapNotify:
+        XkbRefreshKeyboardMapping(&ev->map);
+        keys_refresh();
+        break;
+    case XkbNewKeyboardNotify:
+        keys_refresh();
+        break;
+    case XkbStateNotify:
+        handle_modifier_state(&ev->state);
+        break;
+    }
+}
+
+// Raw input reaches us whichever window has focus; any other key or button cancels a super tap
+static void handle_generic_event(XEvent *e) {
+    XGenericEventCookie *cookie = &e->xcookie;
+    if (cookie->extension != xi_opcode || !XGetEventData(display, cookie))
+        return;
+
+    XIRawEvent *ev = cookie->data;
+    switch (cookie->evtype) {
+    case XI_RawKeyPress:
+        if ((unsigned)ev->detail != super_l_keycode && (unsigned)ev->detail != super_r_keycode)
+            suppress_super_tap();
+        break;
+    case XI_RawButtonPress:
+        suppress_super_tap();
+        break;
+    }
+
+    XFreeEventData(display, cookie);
+}
+
+static void input_setup(void) {
+    int xkb_opcode, xkb_error_base, xkb_major = XkbMajorVersion, xkb_minor = XkbMinorVersion;
+    if (XkbQueryExtension(display, &xkb_opcode, &xkb_event_base, &xkb_error_base, &xkb_major, &xkb_minor)) {
+        XkbSelectEvents(display, XkbUseCoreKbd, XkbNewKeyboardNotifyMask | XkbMapNotifyMask,
+                        XkbNewKeyboardNotifyMask | XkbMapNotifyMask);
+        XkbSelectEventDetails(display, XkbUseCoreKbd, XkbStateNotify,
+                              XkbModifierStateMask, XkbModifierStateMask);
+        // held keys repeat as presses only, see key_repeat_queued
+        Bool detectable;
+        if (!XkbSetDetectableAutoRepeat(display, True, &detectable) || !detectable)
+            LOGN("Detectable autorepeat not supported, held alt-tab redraws every repeat");
+    } else {
+        LOGN("XKB not available, alt-tab and super taps will not see modifier releases");
+    }
+
+    // the server answers with the version it supports, which may be older than asked for
+    int xi_event, xi_error, xi_major = 2, xi_minor = 2;
+    if (XQueryExtension(display, "XInputExtension", &xi_opcode, &xi_event, &xi_error) &&
+        XIQueryVersion(display, &xi_major, &xi_minor) == Success &&
+        (xi_major > 2 || (xi_major == 2 && xi_minor >= 2))) {
+        unsigned char bits[XIMaskLen(XI_LASTEVENT)] = { 0 };
+        XIEventMask mask = { XIAllMasterDevices, sizeof(bits), bits };
+        XISetMask(bits, XI_RawKeyPress);
+        XISetMask(bits, XI_RawButtonPress);
+        XISelectEvents(display, root, &mask, 1);
+    } else {
+        xi_opcode = -1;
+        LOGN("XInput 2.2 not available, only berry's own bindings cancel a super tap");
+    }
+
+    keys_refresh();
+}
+
 static void setup(void) {
-    unsigned long data[1], data2[1];
+    unsigned long data[1];
     int mon;
     XSetWindowAttributes wa = { .override_redirect = true };
+    long start = time_us(), mark, t_grabs, t_atoms, t_monitors, t_font;
     // Setup our conf initially
     conf.b_width = BORDER_WIDTH;
     conf.t_height = TITLE_HEIGHT;
     conf.bottom_height = BOTTOM_HEIGHT;
+    conf.corner_radius = CORNER_RADIUS;
     conf.i_width = INTERNAL_BORDER_WIDTH;
     conf.bf_color = BORDER_FOCUS_COLOR;
     conf.bu_color = BORDER_UNFOCUS_COLOR;
@@ -1712,6 +3509,12 @@ static void setup(void) {
     conf.pointer_interval = POINTER_INTERVAL;
     conf.follow_pointer = FOLLOW_POINTER;
     conf.warp_pointer = WARP_POINTER;
+    conf.hover_delay = HOVER_DELAY_MS;
+    conf.reparent = reparent_windows;
+    if (resuming)
+        handover_begin();
+
+    ws_list = calloc(ws_count, sizeof(struct workspace *));
 
     root = DefaultRootWindow(display);
     screen = DefaultScreen(display);
@@ -1721,42 +3524,26 @@ static void setup(void) {
     normal_cursor = XCreateFontCursor(display, XC_left_ptr);
     XDefineCursor(display, root, normal_cursor);
 
-    alt_keycode = XKeysymToKeycode(display, XK_Alt_L);
-    tab_keycode = XKeysymToKeycode(display, XK_Tab);
-    super_l_keycode = XKeysymToKeycode(display, XK_Super_L);
-    super_r_keycode = XKeysymToKeycode(display, XK_Super_R);
-
     check = XCreateSimpleWindow(display, root, 0, 0, 1, 1, 0, 0, 0);
     nofocus = XCreateSimpleWindow(display, root, -10, -10, 1, 1, 0, 0, 0);
 
     LOGN("selecting root input");
     XSelectInput(display, root,
-                 StructureNotifyMask | SubstructureRedirectMask | SubstructureNotifyMask | ButtonPressMask | Button1Mask);
-    XGrabKey(display, alt_keycode, AnyModifier, root, True, GrabModeAsync, GrabModeAsync);
-    XGrabKey(display, super_l_keycode, AnyModifier, root, True, GrabModeAsync, GrabModeAsync);
-    XGrabKey(display, super_r_keycode, AnyModifier, root, True, GrabModeAsync, GrabModeAsync);
-
-    for (int i = 0; i < num_launchers; i++) {
-        grab_super_key(XKeysymToKeycode(display, launchers[i].keysym), Mod4Mask, root);
-        grab_super_key(XKeysymToKeycode(display, launchers[i].keysym), Mod4Mask, nofocus);
-    }
-
-    for (int i = 0; i < num_nomod_launchers; i++) {
-        grab_super_key(XKeysymToKeycode(display, nomod_launchers[i].keysym), 0, root);
-        grab_super_key(XKeysymToKeycode(display, nomod_launchers[i].keysym), 0, nofocus);
-    }
+                 StructureNotifyMask | SubstructureRedirectMask | SubstructureNotifyMask | ButtonPressMask | Button1Mask);
+    mark = time_us();
+    input_setup();
+    t_grabs = time_us() - mark;
 
-    for (int i = 0; i < num_shortcuts; i++) {
-        grab_super_key(XKeysymToKeycode(display, shortcuts[i].keysym), Mod4Mask, root);
-        grab_super_key(XKeysymToKeycode(display, shortcuts[i].keysym), Mod4Mask, nofocus);
-    }
+    int randr_error;
+    if (XRRQueryExtension(display, &randr_event_base, &randr_error))
+        XRRSelectInput(display, root, RRScreenChangeNotifyMask | RRCrtcChangeNotifyMask | RROutputChangeNotifyMask);
+    else
+        randr_event_base = -1;
 
-    for (int i = 0; i < WORKSPACE_NUMBER; i++) {
-        grab_super_key(XKeysymToKeycode(display, XK_1 + i), Mod4Mask, root);
-        grab_super_key(XKeysymToKeycode(display, XK_1 + i), Mod4Mask|ShiftMask, root);
-    }
+    int shape_event, shape_error;
+    shape_supported = XShapeQueryExtension(display, &shape_event, &shape_error);
 
-        LOGN("selected root input");
+    LOGN("selected root input");
     xerrorxlib = XSetErrorHandler(xerror);
 
     XChangeWindowAttributes(display, nofocus, CWOverrideRedirect, &wa);
@@ -1764,6 +3551,7 @@ static void setup(void) {
     client_manage_focus(NULL);
 
     /* ewmh supported atoms */
+    mark = time_us();
     utf8string = XInternAtom(display, "UTF8_STRING", False);
     net_atom[NetSupported] = XInternAtom(display, "_NET_SUPPORTED", False);
     net_atom[NetNumberOfDesktops] = XInternAtom(display, "_NET_NUMBER_OF_DESKTOPS", False);
@@ -1775,8 +3563,14 @@ static void setup(void) {
     net_atom[NetWMState] = XInternAtom(display, "_NET_WM_STATE", False);
     net_atom[NetWMStateMaximizedVert] = XInternAtom(display, "_NET_WM_STATE_MAXIMIZED_VERT", False);
     net_atom[NetWMStateMaximizedHorz] = XInternAtom(display, "_NET_WM_STATE_MAXIMIZED_HORZ", False);
+    net_atom[NetWMStateHidden] = XInternAtom(display, "_NET_WM_STATE_HIDDEN", False);
+    net_atom[NetWMStateAbove] = XInternAtom(display, "_NET_WM_STATE_ABOVE", False);
+    net_atom[NetWMStateBelow] = XInternAtom(display, "_NET_WM_STATE_BELOW", False);
+    net_atom[NetWMStateSticky] = XInternAtom(display, "_NET_WM_STATE_STICKY", False);
+    net_atom[NetWMStateDemandsAttention] = XInternAtom(display, "_NET_WM_STATE_DEMANDS_ATTENTION", False);
     net_atom[NetWMName] = XInternAtom(display, "_NET_WM_NAME", False);
     net_atom[NetClientList] = XInternAtom(display, "_NET_CLIENT_LIST", False);
+    net_atom[NetClientListStacking] = XInternAtom(display, "_NET_CLIENT_LIST_STACKING", False);
     net_atom[NetWMWindowType] = XInternAtom(display, "_NET_WM_WINDOW_TYPE", False);
     net_atom[NetWMWindowTypeDock] = XInternAtom(display, "_NET_WM_WINDOW_TYPE_DOCK", False);
     net_atom[NetWMWindowTypeToolbar] = XInternAtom(display, "_NET_WM_WINDOW_TYPE_TOOLBAR", False);
@@ -1790,22 +3584,27 @@ static void setup(void) {
     net_atom[NetWMWindowTypeNotification] = XInternAtom(display, "_NET_WM_WINDOW_TYPE_NOTIFICATION", False);
     net_atom[NetWMWindowTypeCombo] = XInternAtom(display, "_NET_WM_WINDOW_TYPE_COMBO", False);
     net_atom[NetWMWindowTypeDND] = XInternAtom(display, "_NET_WM_WINDOW_TYPE_DND", False);
+    net_atom[NetWMWindowTypeDesktop] = XInternAtom(display, "_NET_WM_WINDOW_TYPE_DESKTOP", False);
     net_atom[NetWMDesktop] = XInternAtom(display, "_NET_WM_DESKTOP", False);
     net_atom[NetWMFrameExtents] = XInternAtom(display, "_NET_FRAME_EXTENTS", False);
     net_atom[NetDesktopNames] = XInternAtom(display, "_NET_DESKTOP_NAMES", False);
     net_atom[NetDesktopViewport] = XInternAtom(display, "_NET_DESKTOP_VIEWPORT", False);
     net_atom[NetWMStrut] = XInternAtom(display, "_NET_WM_STRUT", False);
     net_atom[NetWMStrutPartial] = XInternAtom(display, "_NET_WM_STRUT_PARTIAL", False);
+    net_atom[NetWMPing] = XInternAtom(display, "_NET_WM_PING", False);
+    net_atom[NetWMPid] = XInternAtom(display, "_NET_WM_PID", False);
 
     /* Some icccm atoms */
     wm_atom[WMDeleteWindow] = XInternAtom(display, "WM_DELETE_WINDOW", False);
     wm_atom[WMTakeFocus] = XInternAtom(display, "WM_TAKE_FOCUS", False);
     wm_atom[WMProtocols] = XInternAtom(display, "WM_PROTOCOLS", False);
     wm_atom[WMChangeState] = XInternAtom(display, "WM_CHANGE_STATE", False);
-    wm_atom[WMMotifHints] = XInternAtom(display, "_MOTIF_WM_HINTS", False);
+    wm_atom[WMState] = XInternAtom(display, "WM_STATE", False);
 
     /* Internal berry atoms */
     net_berry[BerryWindowConfig] = XInternAtom(display, "BERRY_WINDOW_CONFIG", False);
+    net_berry[BerryFrame] = XInternAtom(display, "BERRY_FRAME", False);
+    t_atoms = time_us() - mark;
 
     LOGN("Successfully assigned atoms");
 
@@ -1817,16 +3616,17 @@ static void setup(void) {
     LOGN("Successfully set initial properties");
 
     /* Set the total number of desktops */
-    data[0] = WORKSPACE_NUMBER;
-    XChangeProperty(display, root, net_atom[NetNumberOfDesktops], XA_CARDINAL, 32, PropModeReplace, (unsigned char *)data, 1);
+    ewmh_set_desktop_count();
 
     /* Set the intial "current desktop" to 0 */
-    data2[0] = curr_ws;
-    XChangeProperty(display, root, net_atom[NetCurrentDesktop], XA_CARDINAL, 32, PropModeReplace, (unsigned char *)data2, 1);
+    data[0] = curr_ws;
+    XChangeProperty(display, root, net_atom[NetCurrentDesktop], XA_CARDINAL, 32, PropModeReplace, (unsigned char *)data, 1);
     LOGN("Setting up monitors");
+    mark = time_us();
     monitors_setup();
+    t_monitors = time_us() - mark;
     LOGN("Successfully setup monitors");
-    mon = ws_m_list[curr_ws];
+    mon = ws_monitor(curr_ws);
     XWarpPointer(display, None, root, 0, 0, 0, 0,
                  m_list[mon].x + m_list[mon].width / 2,
                  m_list[mon].y + m_list[mon].height / 2);
@@ -1838,9 +3638,41 @@ static void setup(void) {
                       TEXT_FOCUS_COLOR, &xft_focus_color);
     XftColorAllocName(display, DefaultVisual(display, screen), DefaultColormap(display, screen),
                       TEXT_UNFOCUS_COLOR, &xft_unfocus_color);
+    XftColorAllocName(display, DefaultVisual(display, screen), DefaultColormap(display, screen),
+                      TEXT_HUNG_COLOR, &xft_hung_color);
+
+    // the X connection must not leak into processes launched by the worker
+    fcntl(ConnectionNumber(display), F_SETFD, FD_CLOEXEC);
+    if (!worker_start())
+        LOGN("Could not start the worker, blocking work stays on the event loop");
+
+    // titles are drawn once run() sees fontconfig ready, see font_open
+    mark = time_us();
+    if (!font_prepare())
+        font_open();
+    t_font = time_us() - mark;
 
-    font = XftFontOpenName(display, screen, global_font);
     ewmh_set_desktop_names();
+    if (resuming)
+        handover_adopt();
+    adopt_windows();
+    LOGP("Setup took %ld us: grabs %ld, atoms %ld, monitors %ld, font %ld",
+         time_us() - start, t_grabs, t_atoms, t_monitors, t_font);
+}
+
+// Open the title font, fontconfig is initialized by now so this does not block long
+static void font_open(void) {
+    long start = time_us();
+
+    font_prepare_finish();
+    font = XftFontOpenName(display, screen, global_font);
+    if (font == NULL) {
+        LOGP("Could not open font %s", global_font);
+        return;
+    }
+
+    LOGP("Opened font %s in %ld us", global_font, time_us() - start);
+    refresh_config(ConfigTitle);
 }
 
 static void client_show(client *c) {
@@ -1857,52 +3689,343 @@ static void client_show(client *c) {
 
 static void client_snap_left(client *c) {
     int mon;
-    mon = ws_m_list[c->ws];
+    mon = ws_monitor(c->ws);
     client_move_absolute(c, m_list[mon].x + conf.left_gap + left_width(c), m_list[mon].y + conf.top_gap + top_height(c));
     client_resize_absolute(c, m_list[mon].width / 2 - conf.left_gap - get_dec_width(c), m_list[mon].height - conf.top_gap - conf.bot_gap - get_dec_height(c));
 }
 
 static void client_snap_right(client *c) {
     int mon;
-    mon = ws_m_list[c->ws];
+    mon = ws_monitor(c->ws);
     client_move_absolute(c, m_list[mon].x + m_list[mon].width / 2 + left_width(c), m_list[mon].y + conf.top_gap + top_height(c));
     client_resize_absolute(c, m_list[mon].width / 2 - conf.right_gap - get_dec_width(c), m_list[mon].height - conf.top_gap - conf.bot_gap - get_dec_height(c));
 }
 
 static void switch_ws(int ws) {
-    if (curr_ws == ws)
-        return;
-    for (int i = 0; i < WORKSPACE_NUMBER; i++) {
-        if (i != ws && ws_m_list[i] == ws_m_list[ws]) {
-            for (client *tmp = c_list[i]; tmp != NULL; tmp = tmp->next) {
-                // hide each client preserving the hidden status
-                int hidden = tmp->hidden;
-                client_hide(tmp);
-                tmp->hidden = hidden;
-            }
-        } else if (i == ws) {
-            suppress_raise = True;
-            for (client *tmp = c_list[i]; tmp != NULL; tmp = tmp->next) {
-                // assume each client is hidden offscreen, and only show those without hidden set
-                if (!tmp->hidden) {
-                    tmp->hidden = true;
-                    client_show(tmp);
-                }
-            }
-            suppress_raise = False;
+    if (curr_ws == ws || ws < 0 || ws >= ws_count)
+        return;
+
+    int mon = ws_monitor(ws);
+    // every other workspace of the monitor goes, whichever of them it showed
+    for (struct workspace *w = ws_used; w != NULL; w = w->next) {
+        if (w->id == ws || ws_mon[w->id] != mon)
+            continue;
+        for (client *tmp = w->c_list; tmp != NULL; tmp = tmp->next) {
+            if (tmp->sticky && w->id == curr_ws)
+                continue; // stays on screen and comes along, see below
+            if (tmp->geom.x >= display_width)
+                continue; // off screen already, x_hide holds where it goes back to
+            // hide each client preserving the hidden status
+            int hidden = tmp->hidden;
+            client_hide(tmp);
+            tmp->hidden = hidden;
+        }
+    }
+
+    // catch up on config changes made while the workspace was off screen
+    if (ws_get(ws) != NULL)
+        ws_refresh(ws_get(ws), 0);
+
+    suppress_raise = True;
+    for (client *tmp = ws_clients(ws); tmp != NULL; tmp = tmp->next) {
+        // assume each client is hidden offscreen, and only show those without hidden set
+        if (!tmp->hidden) {
+            tmp->hidden = true;
+            client_show(tmp);
         }
     }
+    suppress_raise = False;
 
+    int prev = curr_ws;
     curr_ws = ws;
-    int mon = ws_m_list[ws];
-    LOGP("Setting Screen #%d with active workspace %d", m_list[mon].screen, ws);
-    for (client * cur = c_list[curr_ws]; cur != NULL; cur = cur->f_next) {
-        if (!cur->hidden) {
-            client_manage_focus(cur);
-            break;
+
+    // sticky clients follow the workspace shown on their monitor
+    if (ws_monitor(prev) == mon) {
+        client *next;
+        for (client *tmp = ws_clients(prev); tmp != NULL; tmp = next) {
+            next = tmp->next;
+            if (!tmp->sticky)
+                continue;
+            client_delete(tmp);
+            tmp->ws = ws;
+            client_save(tmp, ws);
+            ewmh_set_desktop(tmp, ws);
+            ws_layout_dirty(prev);
+            ws_layout_dirty(ws);
         }
     }
+    LOGP("Setting Screen #%d with active workspace %d", m_list[mon].screen, ws);
+    client *head = ws_focus(curr_ws), *cur = head;
+    if (cur != NULL) {
+        do {
+            if (!cur->hidden) {
+                client_manage_focus(cur);
+                break;
+            }
+            cur = cur->f_next;
+        } while (cur != head);
+    }
     ewmh_set_active_desktop(ws);
+    ipc_broadcast(IpcEventWorkspace, "workspace %d", ws);
+    crossings_ignore(); // windows hidden and shown under the pointer
+}
+
+// Returns the workspace with the given index, or NULL if it holds no clients
+static struct workspace *ws_get(int ws) {
+    return ws >= 0 && ws < ws_count ? ws_list[ws] : NULL;
+}
+
+// Returns the workspace with the given index, creating it if it is unoccupied
+static struct workspace *ws_acquire(int ws) {
+    struct workspace *w = ws_get(ws);
+    if (w != NULL || ws < 0 || ws >= ws_count)
+        return w;
+
+    w = calloc(1, sizeof(struct workspace));
+    if (w == NULL) {
+        LOGN("Error, calloc could not allocate new workspace");
+        return NULL;
+    }
+    w->id = ws;
+
+    // keep the occupied list ordered so that clients are listed by workspace
+    struct workspace **cur = &ws_used;
+    while (*cur != NULL && (*cur)->id < ws)
+        cur = &((*cur)->next);
+    w->next = *cur;
+    *cur = w;
+
+    ws_list[ws] = w;
+    return w;
+}
+
+// Frees a workspace once its last client has left, tiled workspaces keep their layout
+static void ws_release(struct workspace *w) {
+    if (w->c_list != NULL || w->layout != LayoutFloat)
+        return;
+
+    struct workspace **cur = &ws_used;
+    while (*cur != w)
+        cur = &((*cur)->next);
+    *cur = w->next;
+
+    ws_list[w->id] = NULL;
+    free(w);
+}
+
+static client *ws_clients(int ws) {
+    struct workspace *w = ws_get(ws);
+    return w != NULL ? w->c_list : NULL;
+}
+
+static client *ws_focus(int ws) {
+    struct workspace *w = ws_get(ws);
+    return w != NULL ? w->f_list : NULL;
+}
+
+static int ws_monitor(int ws) {
+    return ws >= 0 && ws < ws_count ? ws_mon[ws] : 0;
+}
+
+// Whether a workspace is on screen on its monitor, the current one or one with a client not parked
+static bool ws_shown(struct workspace *w) {
+    if (w->id == curr_ws)
+        return true;
+    for (client *tmp = w->c_list; tmp != NULL; tmp = tmp->next)
+        if (tmp->geom.x < display_width)
+            return true;
+    return false;
+}
+
+// Change the number of workspaces, folding clients from removed workspaces into the last remaining one
+static void ws_set_count(int count) {
+    count = MAX(1, MIN(count, WORKSPACE_MAX));
+    if (count == ws_count)
+        return;
+
+    LOGP("Setting workspace count to %d", count);
+    if (curr_ws >= count)
+        switch_ws(count - 1);
+
+    for (int i = count; i < ws_count; i++) {
+        unsigned int dirty = ws_get(i) != NULL ? ws_get(i)->dirty : 0;
+        client *c;
+        if (ws_get(i) != NULL) {
+            // let the workspace go once its last client moved, or now if it has none
+            ws_get(i)->layout = LayoutFloat;
+            ws_release(ws_get(i));
+        }
+        while ((c = ws_clients(i)) != NULL) {
+            client_delete(c);
+            c->ws = count - 1;
+            client_save(c, count - 1);
+            ewmh_set_desktop(c, c->ws);
+            if (c->ws == curr_ws && !c->hidden) {
+                // the client was offscreen with its workspace
+                c->hidden = true;
+                client_show(c);
+            }
+        }
+        ws_merge_dirty(count - 1, dirty);
+        ws_layout_dirty(count - 1);
+    }
+
+    struct workspace **list = realloc(ws_list, count * sizeof(struct workspace *));
+    if (list == NULL) {
+        LOGN("Could not resize workspace list");
+        return;
+    }
+    for (int i = ws_count; i < count; i++)
+        list[i] = NULL;
+    ws_list = list;
+    ws_count = count;
+
+    ewmh_set_desktop_count();
+    ewmh_set_desktop_names();
+    keys_refresh(); // digit bindings follow the workspace count
+    ipc_broadcast(IpcEventWorkspace, "workspaces %d", count);
+}
+
+static void ws_next(client *c) {
+    UNUSED(c);
+    switch_ws((curr_ws + 1) % ws_count);
+}
+
+static void ws_layout_set(int ws, int layout) {
+    struct workspace *w = ws_acquire(ws);
+    if (w == NULL || w->layout == layout)
+        return;
+
+    LOGP("Setting workspace %d layout to %s", ws, layout_names[layout]);
+    w->layout = layout;
+    ipc_broadcast(IpcEventWorkspace, "layout %d %s", ws, layout_names[layout]);
+
+    if (layout == LayoutFloat)
+        ws_release(w); // clients stay where the layout left them
+    else
+        ws_layout_dirty(ws);
+}
+
+static void ws_layout_cycle(client *c) {
+    UNUSED(c);
+    struct workspace *w = ws_get(curr_ws);
+    ws_layout_set(curr_ws, ((w != NULL ? w->layout : LayoutFloat) + 1) % LayoutLast);
+}
+
+// Re-tile a workspace, the current one once the pending events are handled and
+// the others when they are shown
+static void ws_layout_dirty(int ws) {
+    struct workspace *w = ws_get(ws);
+    if (w == NULL || w->layout == LayoutFloat)
+        return;
+
+    w->dirty |= ConfigLayout;
+    if (ws == curr_ws)
+        layout_pending = true;
+}
+
+static int client_order_cmp(const void *a, const void *b) {
+    unsigned int x = (*(client *const *)a)->order, y = (*(client *const *)b)->order;
+    return x < y ? 1 : (x > y ? -1 : 0); // newest first, it becomes the master
+}
+
+// The frame rect of the i-th of n tiled clients
+static void layout_cell(int layout, const struct client_geom *area, int i, int n, struct client_geom *cell) {
+    if (layout == LayoutTile) {
+        int master = n > 1 ? area->width * TILE_MASTER_PERCENT / 100 : area->width;
+        if (i == 0) {
+            *cell = (struct client_geom){ area->x, area->y, master, area->height };
+        } else {
+            int y0 = area->y + area->height * (i - 1) / (n - 1);
+            int y1 = area->y + area->height * i / (n - 1);
+            *cell = (struct client_geom){ area->x + master, y0, area->width - master, y1 - y0 };
+        }
+        return;
+    }
+
+    int cols = 1;
+    while (cols * cols < n)
+        cols++;
+    int rows = (n + cols - 1) / cols;
+    int row = i / cols, col = i % cols;
+    int row_len = row == rows - 1 ? n - row * cols : cols; // the last row spreads out
+
+    int x0 = area->x + area->width * col / row_len, x1 = area->x + area->width * (col + 1) / row_len;
+    int y0 = area->y + area->height * row / rows, y1 = area->y + area->height * (row + 1) / rows;
+    *cell = (struct client_geom){ x0, y0, x1 - x0, y1 - y0 };
+}
+
+/* Tile the visible clients of a workspace. All rects are computed in one pass
+ * and each client gets one request for its frame and one for itself, without
+ * the size hint round trip of client_resize_absolute. Clients of workspaces
+ * that are off screen only get their stored position updated. */
+static void ws_layout_apply(struct workspace *w) {
+    static client **tiled = NULL;
+    static int tiled_cap = 0;
+    int n = 0;
+    long start = time_us();
+
+    w->dirty &= ~ConfigLayout;
+    for (client *c = w->c_list; c != NULL; c = c->next) {
+        if (c->hidden || c->fullscreen)
+            continue;
+        if (n == tiled_cap) {
+            int cap = tiled_cap ? tiled_cap * 2 : 32;
+            client **tmp = realloc(tiled, cap * sizeof(client *));
+            if (tmp == NULL)
+                break;
+            tiled = tmp;
+            tiled_cap = cap;
+        }
+        tiled[n++] = c;
+    }
+    if (n == 0)
+        return;
+
+    qsort(tiled, n, sizeof(client *), client_order_cmp);
+
+    int mon = ws_monitor(w->id);
+    struct client_geom area = { m_list[mon].x + conf.left_gap, m_list[mon].y + conf.top_gap,
+                                m_list[mon].width - conf.left_gap - conf.right_gap,
+                                m_list[mon].height - conf.top_gap - conf.bot_gap };
+    bool offscreen = !ws_shown(w);
+
+    for (int i = 0; i < n; i++) {
+        client *c = tiled[i];
+        struct client_geom cell;
+        int bw = c->decorated ? conf.b_width : 0;
+
+        layout_cell(w->layout, &area, i, n, &cell);
+        c->geom.width = MAX(cell.width - get_dec_width(c) - 2 * bw, MINIMUM_DIM);
+        c->geom.height = MAX(cell.height - get_dec_height(c) - 2 * bw, MINIMUM_DIM);
+        c->geom.y = cell.y + top_height(c);
+        if (offscreen)
+            c->x_hide = cell.x + left_width(c);
+        else
+            c->geom.x = cell.x + left_width(c);
+        c->mono = false;
+
+        XMoveResizeWindow(display, c->dec, c->geom.x - left_width(c), c->geom.y - top_height(c),
+                          get_actual_width(c), get_actual_height(c));
+        if (client_beside_frame(c))
+            client_follow_frame(c);
+        else
+            XResizeWindow(display, c->window, c->geom.width, c->geom.height);
+        client_shape(c);
+        client_notify_move(c);
+        client_snapshot(c);
+        draw_text(c, f_client == c);
+        ipc_broadcast(IpcEventGeometry, "geometry 0x%lx %d %d %d %d", c->window,
+                      offscreen ? c->x_hide : c->geom.x, c->geom.y, c->geom.width, c->geom.height);
+    }
+
+    crossings_ignore();
+    LOGP("Tiled %d clients on workspace %d in %ld us", n, w->id, time_us() - start);
+}
+
+static void ws_prev(client *c) {
+    UNUSED(c);
+    switch_ws((curr_ws + ws_count - 1) % ws_count);
 }
 
 static void warp_pointer(client *c) {
@@ -1916,11 +4039,6 @@ static void client_toggle_decorations(client *c) {
         client_decorations_show(c);
 }
 
-static void ewmh_set_fullscreen(client *c, bool fullscreen) {
-    XChangeProperty(display, c->window, net_atom[NetWMState], XA_ATOM, 32,
-                    PropModeReplace, (unsigned char *)&net_atom[NetWMStateFullscreen], fullscreen ? 1 : 0);
-}
-
 static void ewmh_set_viewport(void) {
     unsigned long data[2] = { 0, 0 };
     XChangeProperty(display, root, net_atom[NetDesktopViewport], XA_CARDINAL, 32, PropModeReplace, (unsigned char *)&data, 2);
@@ -1962,81 +4080,104 @@ static void ewmh_set_frame_extents(client *c) {
 }
 
 static void ewmh_set_client_list(void) {
-    /* Remove all current clients */
-    XDeleteProperty(display, root, net_atom[NetClientList]);
-    for (int i = 0; i < WORKSPACE_NUMBER; i++)
-        for (client *tmp = c_list[i]; tmp != NULL; tmp = tmp->next)
-            XChangeProperty(display, root, net_atom[NetClientList], XA_WINDOW, 32, PropModeAppend,
-                            (unsigned char *)&(tmp->window), 1);
-}
-
-static Bool window_is_undecorated(Window window) {
-    Atom actual_type;
-    int actual_format;
-    unsigned long nitems;
-    unsigned long bytes_after;
-    unsigned char *prop = NULL;
-    if (XGetWindowProperty(display, window, wm_atom[WMMotifHints], 0, sizeof(MotifWmHints) / sizeof(long),
-                           False, AnyPropertyType, &actual_type, &actual_format,
-                           &nitems, &bytes_after, &prop) == Success) {
-        if (prop) {
-            MotifWmHints *hints = (MotifWmHints *)prop;
-            if (hints->flags & MWM_HINTS_DECORATIONS && hints->decorations == 0) {
-                XFree(prop);
-                return True; // Window requested to be undecorated
+    static Window *list = NULL;
+    static size_t capacity = 0;
+    size_t n = 0;
+
+    for (struct workspace *w = ws_used; w != NULL; w = w->next) {
+        for (client *tmp = w->c_list; tmp != NULL; tmp = tmp->next) {
+            if (n == capacity) {
+                size_t grow = capacity ? capacity * 2 : 64;
+                Window *tmp_list = realloc(list, grow * sizeof(Window));
+                if (tmp_list == NULL) {
+                    LOGN("Could not grow client list");
+                    break;
+                }
+                list = tmp_list;
+                capacity = grow;
             }
-            XFree(prop);
+            list[n++] = tmp->window;
         }
     }
 
-    return False;
+    /* Replace the whole list in one request */
+    XChangeProperty(display, root, net_atom[NetClientList], XA_WINDOW, 32, PropModeReplace,
+                    (unsigned char *)list, n);
 }
 
 #define REMOVE_EQ(X, Y) X = (X == Y ? 0 : X)
 
 // find all windows that advertise WM_STRUTS and calculate the largest border gaps
+static void struts_apply(const unsigned long *struts) {
+    if (conf.left_gap == struts[0] && conf.right_gap == struts[1] &&
+        conf.top_gap == struts[2] && conf.bot_gap == struts[3])
+        return;
+
+    conf.left_gap = struts[0];
+    conf.right_gap = struts[1];
+    conf.top_gap = struts[2];
+    conf.bot_gap = struts[3];
+    ws_layout_dirty(curr_ws);
+}
+
+// Scan the top level windows for struts on the worker, a burst of unmaps costs two scans at most
 static void window_find_struts(void) {
-    Window *children, root_return, parent_return;
-    int actual_format;
-    unsigned long nitems, bytes_after;
-    unsigned int child_count;
-    Atom actual_type;
-    if (False == XQueryTree(display, root, &root_return, &parent_return, &children, &child_count)) {
-        LOGN("Failed to query tree to find struts");
+    struct worker_msg m = { .job = WorkerStruts };
+
+    if (struts_busy) {
+        struts_stale = true;
+        return;
+    }
+    if (worker_post(&m)) {
+        struts_busy = true;
         return;
     }
+    worker_run(display, &m);
+    if (m.ok)
+        struts_apply(m.value);
+}
 
-    unsigned int max_struts[4] = { 0, 0, 0, 0 };
+// Apply what the worker found, the window a result is about may be gone by now
+static void worker_apply(struct worker_msg *m) {
+    client *c;
+    unsigned char fetch;
 
-    for (unsigned int i = 0; i < child_count; i++) {
-        unsigned long *struts = NULL;
-        Window window = children[i];
-        // try to get _NET_WM_STRUT_PARTIAL first, otherwise _NET_WM_STRUT according to spec
-        if (XGetWindowProperty(display, window, net_atom[NetWMStrutPartial], 0, 12,
-                               False, AnyPropertyType, &actual_type, &actual_format,
-                               &nitems, &bytes_after, (unsigned char **)&struts) != Success) {
-            XGetWindowProperty(display, window, net_atom[NetWMStrut], 0, 4,
-                               False, AnyPropertyType, &actual_type, &actual_format,
-                               &nitems, &bytes_after, (unsigned char **)&struts);
+    switch (m->job) {
+    case WorkerManage:
+        manage_fetched(m);
+        break;
+    case WorkerStruts:
+        struts_busy = false;
+        if (m->ok)
+            struts_apply(m->value);
+        if (struts_stale) {
+            struts_stale = false;
+            window_find_struts();
         }
-
-        if (struts && actual_type == XA_CARDINAL && actual_format == 32 && nitems >= 4) {
-            max_struts[0] = MAX(max_struts[0], struts[0]);
-            max_struts[1] = MAX(max_struts[1], struts[1]);
-            max_struts[2] = MAX(max_struts[2], struts[2]);
-            max_struts[3] = MAX(max_struts[3], struts[3]);
+        break;
+    case WorkerTitle:
+    case WorkerProtocols:
+        c = get_client_from_window(m->window);
+        if (c == NULL || c->window != m->window)
+            break;
+        fetch = m->job == WorkerTitle ? FetchTitle : FetchProtocols;
+        c->fetch_busy &= ~fetch;
+        client_fetched(c, m);
+        if (c->fetch_stale & fetch) {
+            c->fetch_stale &= ~fetch;
+            client_fetch(c, fetch);
         }
-
-        if (struts)
-            XFree(struts);
+        break;
+    case WorkerSpawn:
+    case WorkerShell:
+        if (!m->ok)
+            LOGP("failed to run %s", m->job == WorkerSpawn ? m->file : m->text);
+        else if (m->job == WorkerSpawn)
+            LOGP("started %s %ld us after its key was handled", m->file, m->started - m->asked); // key-to-launch latency
+        break;
+    case WorkerQuit:
+        break;
     }
-
-    XFree(children);
-
-    conf.left_gap = max_struts[0];
-    conf.right_gap = max_struts[1];
-    conf.top_gap = max_struts[2];
-    conf.bot_gap = max_struts[3];
 }
 
 /*
@@ -2046,16 +4187,19 @@ static void window_find_struts(void) {
  * index of that workspace.
  */
 static void ewmh_set_desktop_names(void) {
-    char **list = calloc(WORKSPACE_NUMBER, sizeof(char *));
-    for (int i = 0; i < WORKSPACE_NUMBER; i++)
-        asprintf(&list[i], "%d", i);
-    XTextProperty text_prop;
-    Xutf8TextListToTextProperty(display, list, WORKSPACE_NUMBER, XUTF8StringStyle, &text_prop);
-    XSetTextProperty(display, root, &text_prop, XInternAtom(display, "_NET_DESKTOP_NAMES", False));
-    XFree(text_prop.value);
-    for (int i = 0; i < WORKSPACE_NUMBER; i++)
-        free(list[i]);
-    free(list);
+    char names[WORKSPACE_MAX * 4]; /* NUL separated, at most three digits each */
+    int len = 0;
+    for (int i = 0; i < ws_count; i++)
+        len += snprintf(names + len, sizeof(names) - len, "%d", i) + 1;
+    XChangeProperty(display, root, net_atom[NetDesktopNames], utf8string, 8,
+                    PropModeReplace, (unsigned char *)names, len);
+}
+
+static void ewmh_set_desktop_count(void) {
+    unsigned long data[1];
+    data[0] = ws_count;
+    XChangeProperty(display, root, net_atom[NetNumberOfDesktops], XA_CARDINAL, 32,
+                    PropModeReplace, (unsigned char *)data, 1);
 }
 
 static void ewmh_set_active_desktop(int ws) {
@@ -2066,7 +4210,7 @@ static void ewmh_set_active_desktop(int ws) {
 }
 
 static void usage(void) {
-    printf("Usage: berry [-h|-v|-c CONFIG_PATH]\n");
+    printf("Usage: berry [-h|-v|-d|-n|-c CONFIG_PATH]\n");
     exit(EXIT_SUCCESS);
 }
 
@@ -2089,6 +4233,7 @@ static int xerror(Display *dpy, XErrorEvent *e) {
         (e->request_code == X_ConfigureWindow && e->error_code == BadMatch) ||
         (e->request_code == X_GrabButton && e->error_code == BadAccess) ||
         (e->request_code == X_GrabKey && e->error_code == BadAccess) ||
+        (e->request_code == X_KillClient && e->error_code == BadValue) ||
         (e->request_code == X_CopyArea && e->error_code == BadDrawable) ||
         (e->request_code == 139 && e->error_code == BadDrawable) ||
         (e->request_code == 139 && e->error_code == 143)) {
@@ -2100,19 +4245,6 @@ static int xerror(Display *dpy, XErrorEvent *e) {
     return xerrorxlib(dpy, e);
 }
 
-int get_actual_x(client *c) {
-    int b_width = c->decorated ? conf.b_width : 0;
-    int i_width = c->decorated ? conf.i_width : 0;
-    return c->geom.x - b_width - i_width;
-}
-
-int get_actual_y(client *c) {
-    int t_height = c->decorated ? conf.t_height : 0;
-    int b_width = c->decorated ? conf.b_width : 0;
-    int i_width = c->decorated ? conf.i_width : 0;
-    return c->geom.y - b_width - i_width - t_height;
-}
-
 int get_actual_width(client *c) {
     return c->geom.width + get_dec_width(c);
 }
@@ -2145,7 +4277,7 @@ static void feature_toggle(client *c) {
 static void toggle_hide_all(client *_c) {
     UNUSED(_c);
     bool something_hid = false;
-    client *c = c_list[curr_ws];
+    client *c = ws_clients(curr_ws);
     while (c) {
         if (!c->hidden) {
             client_hide(c);
@@ -2159,7 +4291,7 @@ static void toggle_hide_all(client *_c) {
         return;
     }
 
-    c = c_list[curr_ws];
+    c = ws_clients(curr_ws);
     while (c) {
         client_show(c);
         c = c->next;
@@ -2172,6 +4304,12 @@ static void stop(client * c) {
     running = false;
 }
 
+static void restart(client *c) {
+    UNUSED(c);
+    restarting = true;
+    running = false;
+}
+
 static void suppress_super_tap(void) {
     super_l_only_pressed = super_r_only_pressed = false;
 }
@@ -2220,18 +4358,44 @@ static Bool check_running(void) {
     return result;
 }
 
+static const config_setter *config_find(const char *key) {
+    if (key == NULL)
+        return NULL;
+
+    for (unsigned int i = 0; i < sizeof(setters) / sizeof(config_setter); i++) {
+        if (0 == strcmp(key, setters[i].key))
+            return &setters[i];
+    }
+
+    return NULL;
+}
+
+// Config values are always given in hex, with or without the 0x prefix
+static bool config_parse_value(const char *value, unsigned int *out) {
+    char *endptr;
+
+    if (value == NULL)
+        return false;
+
+    unsigned long ui_value = strtoul(value, &endptr, 16);
+    if (endptr == value || ui_value > UINT_MAX || *endptr != '\0')
+        return false;
+
+    *out = ui_value;
+    return true;
+}
+
 static void send_config(const char *key, const char *value) {
     for (unsigned int i = 0; i < sizeof(setters) / sizeof(config_setter); i++) {
         if (0 == strcmp(key, setters[i].key)) {
-            char *endptr;
-            unsigned long ui_value = strtoul(value, &endptr, 16);
-            if (endptr == value || ui_value == ULONG_MAX || *endptr != '\0') {
+            unsigned int ui_value;
+            if (!config_parse_value(value, &ui_value)) {
                 printf("could not parse %s as an unsigned integer\n", value);
                 return;
             }
 
             Window local_root = DefaultRootWindow(display);
-            printf("send %s = 0x%x to window 0x%x\n", key, (int)ui_value, (int)local_root);
+            printf("send %s = 0x%x to window 0x%x\n", key, ui_value, (int)local_root);
 
             XClientMessageEvent cev;
             memset(&cev, 0, sizeof(XClientMessageEvent));
@@ -2262,7 +4426,7 @@ static void update_config(unsigned int offset, unsigned int value) {
             LOGP("setting %s to %u (0x%x)", setters[i].key, value, value);
             unsigned int *setting = (unsigned int *)((char *)&conf + setters[i].offset);
             *setting = value;
-            refresh_config();
+            refresh_config(setters[i].dirty);
             return;
         }
     }
@@ -2270,6 +4434,336 @@ static void update_config(unsigned int offset, unsigned int value) {
     LOGP("no setter for offset 0x%x", offset);
 }
 
+// Find the client named by an IPC argument, either a window id or "focused"
+static client *ipc_client(const char *arg) {
+    char *endptr;
+
+    if (arg == NULL)
+        return NULL;
+    if (0 == strcmp(arg, "focused"))
+        return f_client;
+
+    unsigned long w = strtoul(arg, &endptr, 0);
+    if (endptr == arg || *endptr != '\0')
+        return NULL;
+
+    return get_client_from_window(w);
+}
+
+static bool ipc_int(const char *arg, int *out) {
+    char *endptr;
+
+    if (arg == NULL)
+        return false;
+
+    long value = strtol(arg, &endptr, 10);
+    if (endptr == arg || *endptr != '\0' || value < INT_MIN || value > INT_MAX)
+        return false;
+
+    *out = value;
+    return true;
+}
+
+// Reply with the windows managed on one workspace, or on all of them when ws is -1
+static void ipc_reply_clients(struct ipc_conn *conn, int ws) {
+    size_t count = 0, len = 0;
+    char *buf;
+
+    for (struct workspace *w = ws_used; w != NULL; w = w->next)
+        for (client *c = w->c_list; c != NULL; c = c->next)
+            count++;
+
+    buf = malloc(count * 20 + 1);
+    if (buf == NULL) {
+        ipc_reply(conn, "error out of memory");
+        return;
+    }
+
+    buf[0] = '\0';
+    for (struct workspace *w = ws_used; w != NULL; w = w->next) {
+        if (ws != -1 && w->id != ws)
+            continue;
+        for (client *c = w->c_list; c != NULL; c = c->next)
+            len += sprintf(buf + len, "%s0x%lx", len ? " " : "", c->window);
+    }
+
+    ipc_reply(conn, "%s", buf);
+    free(buf);
+}
+
+static const char *const ipc_event_names[] = { "focus", "title", "map", "geometry", "workspace" };
+
+// Run one IPC command and reply with exactly one line.  Returns what the command
+// invalidated in the config, the caller refreshes once for the whole batch.
+static unsigned int ipc_command(struct ipc_conn *conn, char *line) {
+    char *save = NULL;
+    char *cmd = strtok_r(line, " \t", &save);
+    char *arg = strtok_r(NULL, " \t", &save);
+    char *arg2 = strtok_r(NULL, " \t", &save);
+    const config_setter *setter;
+    unsigned int value;
+    client *c;
+    int n;
+
+    LOGP("ipc command %s", cmd);
+
+    if (0 == strcmp(cmd, "set")) {
+        if ((setter = config_find(arg)) == NULL) {
+            ipc_reply(conn, "error unknown setting %s", arg ? arg : "");
+        } else if (!config_parse_value(arg2, &value)) {
+            ipc_reply(conn, "error could not parse %s as an unsigned integer", arg2 ? arg2 : "");
+        } else {
+            LOGP("setting %s to %u (0x%x)", setter->key, value, value);
+            *(unsigned int *)((char *)&conf + setter->offset) = value;
+            ipc_reply(conn, "ok");
+            return setter->dirty;
+        }
+    } else if (0 == strcmp(cmd, "get")) {
+        if ((setter = config_find(arg)) == NULL)
+            ipc_reply(conn, "error unknown setting %s", arg ? arg : "");
+        else
+            ipc_reply(conn, "0x%x", *(unsigned int *)((char *)&conf + setter->offset));
+    } else if (0 == strcmp(cmd, "workspace")) {
+        if (arg == NULL) {
+            ipc_reply(conn, "%d", curr_ws);
+        } else if (!ipc_int(arg, &n) || n < 0 || n >= ws_count) {
+            ipc_reply(conn, "error no workspace %s", arg);
+        } else {
+            switch_ws(n);
+            ipc_reply(conn, "ok");
+        }
+    } else if (0 == strcmp(cmd, "workspaces")) {
+        if (arg == NULL) {
+            ipc_reply(conn, "%d", ws_count);
+        } else if (!ipc_int(arg, &n)) {
+            ipc_reply(conn, "error could not parse %s as a number", arg);
+        } else {
+            ws_set_count(n);
+            ipc_reply(conn, "%d", ws_count);
+        }
+    } else if (0 == strcmp(cmd, "stats")) {
+        unsigned long in, dispatched;
+        events_counts(&in, &dispatched);
+        ipc_reply(conn, "events %lu dispatched %lu deferred %d", in, dispatched, events_deferred());
+    } else if (0 == strcmp(cmd, "focused")) {
+        if (f_client == NULL)
+            ipc_reply(conn, "none");
+        else
+            ipc_reply(conn, "0x%lx", f_client->window);
+    } else if (0 == strcmp(cmd, "clients")) {
+        if (arg != NULL && (!ipc_int(arg, &n) || n < 0 || n >= ws_count))
+            ipc_reply(conn, "error no workspace %s", arg);
+        else
+            ipc_reply_clients(conn, arg == NULL ? -1 : n);
+    } else if (0 == strcmp(cmd, "client")) {
+        if ((c = ipc_client(arg)) == NULL)
+            ipc_reply(conn, "error no client %s", arg ? arg : "");
+        else
+            ipc_reply(conn, "0x%lx %d %d %d %d %d %s%s%s%s %s", c->window, c->ws,
+                      c->geom.x, c->geom.y, c->geom.width, c->geom.height,
+                      c->hidden ? "h" : "-", c->fullscreen ? "f" : "-",
+                      c->mono ? "m" : "-", c->decorated ? "d" : "-", c->title);
+    } else if (0 == strcmp(cmd, "focus")) {
+        if ((c = ipc_client(arg)) == NULL) {
+            ipc_reply(conn, "error no client %s", arg ? arg : "");
+        } else {
+            client_manage_focus(c);
+            ipc_reply(conn, "ok");
+        }
+    } else if (0 == strcmp(cmd, "close")) {
+        if ((c = ipc_client(arg)) == NULL) {
+            ipc_reply(conn, "error no client %s", arg ? arg : "");
+        } else {
+            client_close(c);
+            ipc_reply(conn, "ok");
+        }
+    } else if (0 == strcmp(cmd, "send")) {
+        if ((c = ipc_client(arg)) == NULL) {
+            ipc_reply(conn, "error no client %s", arg ? arg : "");
+        } else if (!ipc_int(arg2, &n) || n < 0 || n >= ws_count) {
+            ipc_reply(conn, "error no workspace %s", arg2 ? arg2 : "");
+        } else {
+            if (c->ws != n)
+                client_send_to_ws(c, n);
+            ipc_reply(conn, "ok");
+        }
+    } else if (0 == strcmp(cmd, "layout")) {
+        int layout = -1;
+        for (int i = 0; arg != NULL && i < LayoutLast; i++)
+            if (0 == strcmp(arg, layout_names[i]))
+                layout = i;
+
+        // a lone workspace number asks for the layout of that workspace
+        bool query = arg == NULL || (layout == -1 && arg2 == NULL && ipc_int(arg, &n));
+        int ws = query && arg != NULL ? n : curr_ws;
+
+        if (arg2 != NULL && (!ipc_int(arg2, &n) || n < 0 || n >= ws_count)) {
+            ipc_reply(conn, "error no workspace %s", arg2);
+        } else if (query && (ws < 0 || ws >= ws_count)) {
+            ipc_reply(conn, "error no workspace %s", arg);
+        } else if (query) {
+            ipc_reply(conn, "%s", layout_names[ws_get(ws) != NULL ? ws_get(ws)->layout : LayoutFloat]);
+        } else if (layout == -1) {
+            ipc_reply(conn, "error unknown layout %s", arg);
+        } else {
+            ws_layout_set(arg2 != NULL ? n : curr_ws, layout);
+            ipc_reply(conn, "ok");
+        }
+    } else if (0 == strcmp(cmd, "restart")) {
+        ipc_reply(conn, "ok");
+        restart(NULL);
+    } else if (0 == strcmp(cmd, "subscribe")) {
+        unsigned int events = 0;
+        char *topic = arg, *bad = NULL;
+
+        while (topic != NULL && bad == NULL) {
+            unsigned int event = 0;
+            if (0 == strcmp(topic, "all"))
+                event = IpcEventAll;
+            for (unsigned int i = 0; i < sizeof(ipc_event_names) / sizeof(ipc_event_names[0]); i++)
+                if (0 == strcmp(topic, ipc_event_names[i]))
+                    event = 1 << i;
+            if (event == 0)
+                bad = topic;
+            events |= event;
+            topic = topic == arg ? arg2 : strtok_r(NULL, " \t", &save);
+        }
+
+        if (bad != NULL) {
+            ipc_reply(conn, "error unknown event %s", bad);
+        } else {
+            ipc_subscribe(conn, events ? events : IpcEventAll);
+            ipc_reply(conn, "ok");
+        }
+    } else {
+        ipc_reply(conn, "error unknown command %s", cmd);
+    }
+
+    return 0;
+}
+
+static void ipc_handle_batch(struct ipc_conn *conn, char *batch) {
+    unsigned int dirty = 0;
+    char *save = NULL;
+
+    for (char *line = strtok_r(batch, "\n", &save); line != NULL; line = strtok_r(NULL, "\n", &save)) {
+        if (strspn(line, " \t") == strlen(line))
+            continue;
+        dirty |= ipc_command(conn, line);
+    }
+
+    if (dirty)
+        refresh_config(dirty);
+}
+
+// Outputs coming and going arrive as a burst of notifications, they are
+// coalesced into a single monitors_update from the main loop
+static void handle_randr_event(XEvent *e) {
+    XRRUpdateConfiguration(e);
+    if (e->type == randr_event_base + RRScreenChangeNotify) {
+        display_width = DisplayWidth(display, screen);
+        display_height = DisplayHeight(display, screen);
+    }
+    monitors_changed = true;
+}
+
+static void handle_event(XEvent *e) {
+    if (e->type == xkb_event_base)
+        handle_xkb_event(e);
+    else if (randr_event_base != -1 &&
+             (e->type == randr_event_base + RRScreenChangeNotify || e->type == randr_event_base + RRNotify))
+        handle_randr_event(e);
+    else if (event_handler[e->type])
+        event_handler[e->type](e);
+}
+
+// Handle everything Xlib has queued, in batches with redundant events collapsed
+// and input ahead of cosmetic events, then sleep until the X connection or one of
+// the control sockets becomes readable
+static void run(void) {
+    struct pollfd fds[1 + 1 + 1 + 1 + IPC_MAX_CONNS];
+    int xfd = ConnectionNumber(display);
+    XEvent e;
+
+    while (running) {
+        while (running && XPending(display) && events_collect(display) > 0) {
+            while (running && events_next(&e))
+                handle_event(&e);
+        }
+        // cosmetic events only get a slice of each wakeup, the rest waits for the next one
+        long start = time_us();
+        while (running && time_us() - start < DEFER_BUDGET_US && events_next_deferred(&e))
+            handle_event(&e);
+        if (!running)
+            break;
+
+        if (monitors_changed) {
+            monitors_update();
+            continue;
+        }
+
+        if (layout_pending) {
+            layout_pending = false;
+            if (ws_get(curr_ws) != NULL)
+                ws_refresh(ws_get(curr_ws), 0);
+            continue;
+        }
+
+        if (snapshot_pending)
+            snapshot_flush();
+
+        // one restack for every raise and layer change in the burst
+        if (restack_pending) {
+            stack_apply();
+            continue;
+        }
+
+        fds[0].fd = xfd;
+        fds[0].events = POLLIN;
+        int ipc_base = 1, font_slot = -1, worker_slot = -1;
+        if (font_prepare_fd() != -1) {
+            font_slot = ipc_base;
+            fds[ipc_base].fd = font_prepare_fd();
+            fds[ipc_base++].events = POLLIN;
+        }
+        if (worker_fd() != -1) {
+            worker_slot = ipc_base;
+            fds[ipc_base].fd = worker_fd();
+            fds[ipc_base++].events = POLLIN;
+        }
+        int n = ipc_base + ipc_pollfds(fds + ipc_base, sizeof(fds) / sizeof(fds[0]) - ipc_base);
+
+        /* A timer that fired drew, focused or raised something, go around so the
+         * restack pass sees it and XPending flushes it before the next poll */
+        unsigned long serial = NextRequest(display);
+        int timeout = ping_check(), hover = hover_check(), held = configure_check(), term = kill_check();
+        if (NextRequest(display) != serial)
+            continue;
+        if (term != -1 && (timeout == -1 || term < timeout))
+            timeout = term;
+        if (hover != -1 && (timeout == -1 || hover < timeout))
+            timeout = hover;
+        if (held != -1 && (timeout == -1 || held < timeout))
+            timeout = held;
+        // deferred handlers may have read replies, which queues the events that came with them
+        if (events_deferred() > 0 || XQLength(display) > 0)
+            timeout = 0;
+        XFlush(display);
+        if (poll(fds, n, timeout) < 0) {
+            if (errno == EINTR)
+                continue;
+            LOGP("poll failed: %s", strerror(errno));
+            break;
+        }
+
+        if (font_slot != -1 && fds[font_slot].revents)
+            font_open();
+        if (worker_slot != -1 && fds[worker_slot].revents)
+            worker_results(worker_apply);
+        ipc_dispatch(fds + ipc_base, n - ipc_base);
+    }
+}
+
 int main(int argc, char *argv[]) {
     int opt;
     char *conf_path = malloc(MAXLEN * sizeof(char));
@@ -2278,7 +4772,7 @@ int main(int argc, char *argv[]) {
     conf_path[0] = '\0';
     font_name[0] = '\0';
 
-    while ((opt = getopt(argc, argv, "dhf:vc:")) != -1) {
+    while ((opt = getopt(argc, argv, "dhf:vc:n")) != -1) {
         switch (opt) {
         case 'h':
             usage();
@@ -2295,9 +4789,14 @@ int main(int argc, char *argv[]) {
         case 'd':
             debug = true;
             break;
+        case 'n':
+            reparent_windows = false;
+            break;
         }
     }
 
+    // the worker thread has a display of its own, but Xlib keeps some state per process
+    XInitThreads();
     display = XOpenDisplay(NULL);
 
     if (!display)
@@ -2338,31 +4837,51 @@ int main(int argc, char *argv[]) {
     }
 
     LOGN("Successfully opened display");
+    resuming = restart_resume();
+
+    char state_path[MAXLEN];
+    snapshot_path(state_path, sizeof(state_path));
+    if (!snapshot_open(state_path))
+        LOGP("Could not open %s, window state will not survive a restart", state_path);
 
     setup();
-    if (conf_found) {
+    // the autostart already ran for the clients and settings a restart hands over
+    if (conf_found && !resuming) {
         signal(SIGCHLD, SIG_IGN);
         load_config(conf_path);
     }
 
-    XEvent e;
+    char socket_path[MAXLEN];
+    ipc_socket_path(socket_path, sizeof(socket_path));
+    if (ipc_listen(socket_path, ipc_handle_batch))
+        LOGP("Listening for commands on %s", socket_path);
+    else
+        LOGP("Could not listen on %s: %s", socket_path, strerror(errno));
+
     XSync(display, false);
-    while (running) {
-        XNextEvent(display, &e);
-        if (event_handler[e.type])
-            event_handler[e.type](&e);
-    }
+    run();
+    ipc_close();
+    snapshot_flush();
+    snapshot_close();
+    if (restarting)
+        handover_exec(argv);
 
     LOGN("Shutting down window manager");
-    for (int i = 0; i < WORKSPACE_NUMBER; i++) {
-        while (c_list[i] != NULL) {
-            client_delete(c_list[i]);
+    for (int i = 0; i < ws_count; i++) {
+        while (ws_clients(i) != NULL) {
+            client_release(ws_clients(i));
+            client_delete(ws_clients(i));
         }
     }
+    // frames handed over by a restart are gone, so is the need for the connections that made them
+    if (resuming)
+        XKillClient(display, AllTemporary);
 
     XDeleteProperty(display, root, net_atom[NetSupported]);
+    monitors_free();
 
     LOGN("Closing display...");
+    worker_stop();
     XCloseDisplay(display);
 
     free(font_name);
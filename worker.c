@@ -0,0 +1,335 @@
+/* Worker thread for blocking X queries and process launches, see worker.h
+ *
+ * Jobs and results travel through two single producer, single consumer rings.
+ * The main thread never has more jobs in flight than a ring holds, so the
+ * worker can always push its result without waiting. */
+
+#define _GNU_SOURCE 1
+
+#include "worker.h"
+#include "globals.h"
+#include "utils.h"
+
+#include <X11/Xatom.h>
+#include <X11/Xutil.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+struct ring {
+    atomic_size_t head; /* next slot to read, written by the consumer only */
+    atomic_size_t tail; /* next slot to write, written by the producer only */
+    struct worker_msg slots[WORKER_QUEUE_SIZE];
+};
+
+#define MWM_HINTS_DECORATIONS (1L << 1)
+
+static struct ring jobs, results;
+static Display *worker_display = NULL;
+static pthread_t thread;
+static int job_fd = -1, result_fd = -1;
+static int inflight = 0; /* jobs posted but not yet handed to worker_results */
+
+static bool ring_push(struct ring *r, const struct worker_msg *m) {
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    if (tail - atomic_load_explicit(&r->head, memory_order_acquire) == WORKER_QUEUE_SIZE)
+        return false;
+
+    r->slots[tail & (WORKER_QUEUE_SIZE - 1)] = *m;
+    atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+static bool ring_pop(struct ring *r, struct worker_msg *m) {
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    if (head == atomic_load_explicit(&r->tail, memory_order_acquire))
+        return false;
+
+    *m = r->slots[head & (WORKER_QUEUE_SIZE - 1)];
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+    return true;
+}
+
+static void notify(int fd) {
+    uint64_t one = 1;
+    while (write(fd, &one, sizeof(one)) < 0 && errno == EINTR)
+        ;
+}
+
+static void *work(void *arg) {
+    struct worker_msg m;
+    uint64_t n;
+
+    (void)arg;
+    for (;;) {
+        if (read(job_fd, &n, sizeof(n)) < 0 && errno != EINTR)
+            return NULL;
+
+        bool done = false;
+        while (ring_pop(&jobs, &m)) {
+            if (m.job == WorkerQuit)
+                return NULL;
+            worker_run(worker_display, &m);
+            ring_push(&results, &m);
+            done = true;
+        }
+        if (done)
+            notify(result_fd);
+    }
+}
+
+bool worker_start(void) {
+    if (worker_display != NULL)
+        return true;
+
+    if ((worker_display = XOpenDisplay(NULL)) == NULL)
+        return false;
+
+    job_fd = eventfd(0, EFD_CLOEXEC);
+    result_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (job_fd < 0 || result_fd < 0 || pthread_create(&thread, NULL, work, NULL) != 0) {
+        if (job_fd >= 0)
+            close(job_fd);
+        if (result_fd >= 0)
+            close(result_fd);
+        job_fd = result_fd = -1;
+        XCloseDisplay(worker_display);
+        worker_display = NULL;
+        return false;
+    }
+    return true;
+}
+
+// Let the worker finish the jobs before the quit, results still queued are dropped
+void worker_stop(void) {
+    struct worker_msg m = { .job = WorkerQuit };
+
+    if (worker_display == NULL)
+        return;
+
+    // the quit needs a free slot, which the worker makes as it goes
+    while (!ring_push(&jobs, &m))
+        sched_yield();
+    notify(job_fd);
+    pthread_join(thread, NULL);
+
+    close(job_fd);
+    close(result_fd);
+    job_fd = result_fd = -1;
+    XCloseDisplay(worker_display);
+    worker_display = NULL;
+    atomic_store(&jobs.head, 0);
+    atomic_store(&jobs.tail, 0);
+    atomic_store(&results.head, 0);
+    atomic_store(&results.tail, 0);
+    inflight = 0;
+}
+
+int worker_fd(void) {
+    return result_fd;
+}
+
+bool worker_post(const struct worker_msg *m) {
+    if (worker_display == NULL || inflight == WORKER_QUEUE_SIZE || !ring_push(&jobs, m))
+        return false;
+
+    inflight++;
+    notify(job_fd);
+    return true;
+}
+
+void worker_results(void (*apply)(struct worker_msg *m)) {
+    struct worker_msg m;
+    uint64_t n;
+
+    // clear the wakeup first, a result pushed after this writes a new one
+    if (read(result_fd, &n, sizeof(n)) < 0 && errno != EAGAIN && errno != EINTR)
+        return;
+
+    while (ring_pop(&results, &m)) {
+        inflight--;
+        apply(&m);
+    }
+}
+
+static bool spawn(const char *file, char *const argv[]) {
+    posix_spawnattr_t attr;
+    sigset_t def;
+    pid_t pid;
+
+    // a new session, and SIGCHLD back to default as berry ignores it
+    sigemptyset(&def);
+    sigaddset(&def, SIGCHLD);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSID | POSIX_SPAWN_SETSIGDEF);
+    posix_spawnattr_setsigdefault(&attr, &def);
+    int err = posix_spawnp(&pid, file, NULL, &attr, argv, environ);
+    posix_spawnattr_destroy(&attr);
+    return err == 0;
+}
+
+static void fetch_title(Display *dpy, struct worker_msg *m) {
+    XTextProperty tp;
+    char **slist = NULL;
+    int count;
+
+    m->text[0] = '\0';
+    m->ok = XGetTextProperty(dpy, m->window, &tp, XInternAtom(dpy, "_NET_WM_NAME", False));
+    if (!m->ok)
+        return;
+
+    if (tp.encoding == XA_STRING) {
+        strncpy(m->text, (char *)tp.value, sizeof(m->text) - 1);
+    } else if (XmbTextPropertyToTextList(dpy, &tp, &slist, &count) >= Success && count > 0 && *slist) {
+        strncpy(m->text, slist[0], sizeof(m->text) - 1);
+        XFreeStringList(slist);
+    }
+    m->text[sizeof(m->text) - 1] = '\0';
+    XFree(tp.value);
+}
+
+static void fetch_protocols(Display *dpy, struct worker_msg *m) {
+    Atom *protocols;
+    int n;
+
+    m->count = 0;
+    m->ok = XGetWMProtocols(dpy, m->window, &protocols, &n);
+    if (!m->ok)
+        return;
+
+    for (int i = 0; i < n && m->count < WORKER_VALUES; i++)
+        m->value[m->count++] = protocols[i];
+    XFree(protocols);
+}
+
+/* Every property berry reads from a window it is asked to map, so that none of
+ * them costs the event loop a round trip */
+static void fetch_manage(Display *dpy, struct worker_msg *m) {
+    Atom type;
+    int format;
+    unsigned long count, after;
+    unsigned char *prop = NULL;
+    Atom *protocols;
+    int n;
+    XClassHint ch;
+    Window parent;
+
+    memset(m->value, 0, sizeof(m->value));
+    m->count = 0;
+    m->ok = true;
+
+    if (XGetWindowProperty(dpy, m->window, XInternAtom(dpy, "_NET_WM_WINDOW_TYPE", False), 0, 1, False,
+                           XA_ATOM, &type, &format, &count, &after, &prop) == Success && prop != NULL) {
+        if (count > 0)
+            m->value[ManageType] = ((Atom *)prop)[0];
+        XFree(prop);
+    }
+    if (XGetTransientForHint(dpy, m->window, &parent))
+        m->value[ManageTransient] = parent;
+    if (XGetClassHint(dpy, m->window, &ch)) {
+        m->value[ManageFlags] |= ManageClassHint;
+        if (ch.res_class)
+            XFree(ch.res_class);
+        if (ch.res_name)
+            XFree(ch.res_name);
+    }
+
+    // flags, functions, decorations, input mode and status
+    prop = NULL;
+    if (XGetWindowProperty(dpy, m->window, XInternAtom(dpy, "_MOTIF_WM_HINTS", False), 0, 5, False,
+                           AnyPropertyType, &type, &format, &count, &after, &prop) == Success && prop != NULL) {
+        long *hints = (long *)prop;
+        if (count >= 3 && hints[0] & MWM_HINTS_DECORATIONS && hints[2] == 0)
+            m->value[ManageFlags] |= ManageUndecorated;
+        XFree(prop);
+    }
+
+    if (XGetWMProtocols(dpy, m->window, &protocols, &n)) {
+        for (int i = 0; i < n && ManageAtoms + m->count < WORKER_VALUES; i++)
+            m->value[ManageAtoms + m->count++] = protocols[i];
+        XFree(protocols);
+    }
+    prop = NULL;
+    if (XGetWindowProperty(dpy, m->window, XInternAtom(dpy, "_NET_WM_STATE", False), 0, WORKER_VALUES, False,
+                           XA_ATOM, &type, &format, &count, &after, &prop) == Success && prop != NULL) {
+        for (unsigned long i = 0; i < count && ManageAtoms + m->count < WORKER_VALUES; i++)
+            m->value[ManageAtoms + m->count++] = ((Atom *)prop)[i];
+        XFree(prop);
+    }
+}
+
+static void fetch_struts(Display *dpy, struct worker_msg *m) {
+    Window *children, root_return, parent_return;
+    Atom strut_partial = XInternAtom(dpy, "_NET_WM_STRUT_PARTIAL", False);
+    Atom strut = XInternAtom(dpy, "_NET_WM_STRUT", False);
+    Atom actual_type;
+    int actual_format;
+    unsigned long nitems, bytes_after;
+    unsigned int child_count;
+
+    memset(m->value, 0, sizeof(m->value));
+    m->ok = XQueryTree(dpy, DefaultRootWindow(dpy), &root_return, &parent_return, &children, &child_count);
+    if (!m->ok)
+        return;
+
+    for (unsigned int i = 0; i < child_count; i++) {
+        unsigned long *struts = NULL;
+        // try to get _NET_WM_STRUT_PARTIAL first, otherwise _NET_WM_STRUT according to spec
+        if (XGetWindowProperty(dpy, children[i], strut_partial, 0, 12, False, AnyPropertyType,
+                               &actual_type, &actual_format, &nitems, &bytes_after,
+                               (unsigned char **)&struts) != Success) {
+            XGetWindowProperty(dpy, children[i], strut, 0, 4, False, AnyPropertyType,
+                               &actual_type, &actual_format, &nitems, &bytes_after,
+                               (unsigned char **)&struts);
+        }
+
+        if (struts && actual_type == XA_CARDINAL && actual_format == 32 && nitems >= 4)
+            for (int j = 0; j < 4; j++)
+                m->value[j] = MAX(m->value[j], struts[j]);
+
+        if (struts)
+            XFree(struts);
+    }
+
+    if (children)
+        XFree(children);
+}
+
+void worker_run(Display *dpy, struct worker_msg *m) {
+    switch (m->job) {
+    case WorkerSpawn: {
+        char *argv[32] = { (char *)m->file };
+        int argc = 1;
+        for (int i = 0; m->argv != NULL && m->argv[i] != NULL && argc < 31; i++)
+            argv[argc++] = m->argv[i];
+        argv[argc] = NULL;
+        m->ok = spawn(m->file, argv);
+        m->started = time_us();
+        break;
+    }
+    case WorkerShell:
+        m->ok = spawn("/bin/sh", (char *[]){ "sh", m->text, NULL });
+        break;
+    case WorkerTitle:
+        fetch_title(dpy, m);
+        break;
+    case WorkerProtocols:
+        fetch_protocols(dpy, m);
+        break;
+    case WorkerStruts:
+        fetch_struts(dpy, m);
+        break;
+    case WorkerManage:
+        fetch_manage(dpy, m);
+        break;
+    case WorkerQuit:
+        break;
+    }
+}
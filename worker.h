@@ -0,0 +1,59 @@
+#ifndef _BERRY_WORKER_H_
+#define _BERRY_WORKER_H_
+
+#include "types.h"
+
+/* Blocking work runs on a thread with its own display connection, so a slow
+ * client or a slow fork never holds up the event loop. Jobs go in through
+ * worker_post and come back, in order, through worker_results once worker_fd
+ * polls readable. Every job also runs synchronously through worker_run, which
+ * is what callers fall back to when worker_post fails. */
+
+enum worker_job {
+    WorkerQuit,
+    WorkerSpawn,     /* launch file with argv, both must outlive the job */
+    WorkerShell,     /* run the script at text with /bin/sh */
+    WorkerTitle,     /* text = title of window */
+    WorkerProtocols, /* value = WM_PROTOCOLS atoms of window, count of them */
+    WorkerStruts,    /* value = largest left, right, top and bottom strut */
+    WorkerManage,    /* value = what a new window is managed by, see worker_manage */
+};
+
+#define WORKER_VALUES 24
+
+/* The values of a WorkerManage job, the WM_PROTOCOLS and _NET_WM_STATE atoms
+ * follow from ManageAtoms on, count of them */
+enum worker_manage {
+    ManageType,      /* first _NET_WM_WINDOW_TYPE atom, None without one */
+    ManageTransient, /* WM_TRANSIENT_FOR, None without one */
+    ManageFlags,     /* manage_flags */
+    ManageAtoms,
+};
+
+enum manage_flags {
+    ManageClassHint = 1 << 0,
+    ManageUndecorated = 1 << 1, /* asked for no decorations through _MOTIF_WM_HINTS */
+};
+
+struct worker_msg {
+    enum worker_job job;
+    Window window;
+    const char *file;
+    char *const *argv;
+    bool ok;
+    int count;
+    unsigned long value[WORKER_VALUES];
+    char text[512];
+    long asked, started; /* time_us() of a spawn request and of its child starting */
+};
+
+bool worker_start(void);
+void worker_stop(void);
+/* -1 while the worker is not running */
+int worker_fd(void);
+/* False if the worker is not running or has too many jobs in flight */
+bool worker_post(const struct worker_msg *m);
+void worker_results(void (*apply)(struct worker_msg *m));
+void worker_run(Display *dpy, struct worker_msg *m);
+
+#endif